@@ -53,18 +53,25 @@
  *        is not set. To completely invalidate the TLB, load it with
  *        translations for addresses in one of the unmapped address
  *        ranges - these will never be matched.
+ *
+ *   tlb_setasid: make ASID the current address space ID. Non-global
+ *        entries only match if their TLBHI_PID field holds the current
+ *        ASID. Note that tlb_random, tlb_write, tlb_read and tlb_probe
+ *        all change the current ASID as a side effect, since they go
+ *        through the same ENTRYHI register.
  */
 
 void tlb_random(uint32_t entryhi, uint32_t entrylo);
 void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
+void tlb_setasid(uint32_t asid);
 
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
+ * Note that the MIPS has support for a 6-bit address space ID, kept in
+ * TLBHI_PID. If you don't use it, the fields related to it
  * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
  * bits that aren't assigned a meaning.
  *
@@ -78,7 +85,8 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -101,5 +109,8 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 #define NUM_TLB  64
 
+/* Number of address space IDs that fit in TLBHI_PID. */
+#define NUM_ASID 64
+
 
 #endif /* _MIPS_TLB_H_ */
@@ -114,6 +114,7 @@ struct tlbshootdown {
 	 */
 	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
+	struct semaphore *ts_done;	/* V'd by each CPU once it is done */
 };
 
 #define TLBSHOOTDOWN_MAX 16
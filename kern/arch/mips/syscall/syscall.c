@@ -38,6 +38,7 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <copyinout.h>
 
 
 /*
@@ -143,6 +144,42 @@ syscall(struct trapframe *tf)
 	  	err = sys_execv((const_userptr_t)tf->tf_a0, (const_userptr_t *)tf->tf_a1, (int *)&retval);
 	  	break;
 #endif	 
+#if OPT_A3
+	  case SYS_open:
+	  	err = sys_open((const_userptr_t)tf->tf_a0, (int)tf->tf_a1,
+	  		       (mode_t)tf->tf_a2, (int *)&retval);
+	  	break;
+	  case SYS_close:
+	  	err = sys_close((int)tf->tf_a0);
+	  	break;
+	  case SYS_sbrk:
+	  	err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+	  	break;
+	  case SYS_mmap:
+	  {
+	  	// fd and the 64-bit offset do not fit in registers any more,
+	  	// the offset is aligned on the user stack
+	  	int fd;
+	  	off_t offset;
+
+	  	err = copyin((const_userptr_t)(tf->tf_sp+16), &fd, sizeof(fd));
+	  	if (err == 0) {
+	  		err = copyin((const_userptr_t)(tf->tf_sp+24), &offset, sizeof(offset));
+	  	}
+	  	if (err == 0) {
+	  		err = sys_mmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+	  			       (int)tf->tf_a2, (int)tf->tf_a3, fd, offset,
+	  			       (vaddr_t *)&retval);
+	  	}
+	  	break;
+	  }
+	  case SYS_munmap:
+	  	err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+	  	break;
+	  case SYS_msync:
+	  	err = sys_msync((userptr_t)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2);
+	  	break;
+#endif
  
 	default:
 	  kprintf("Unknown syscall %d\n", callno);
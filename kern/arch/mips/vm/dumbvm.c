@@ -48,16 +48,127 @@
 
 #if OPT_A3
 
+#include <kern/stat.h>
 #include <mips/trapframe.h>
 #include <synch.h>
 #include <mips/vm.h>
+#include <uio.h>
+#include <vnode.h>
+#include <cpu.h>
+#include <thread.h>
+#include <platform/maxcpus.h>
+#include <swap.h>
+#include <uw-vmstats.h>
 
 // Core-map 
 static struct coremap_entry *core_map;
 
-// Lock for core-map
+// Lock for core-map, also protects the residency state (addr_base,
+// cow, busy, swapped) of every page table entry
 static struct lock *core_map_lock;
 
+// Signalled whenever a page table entry stops being busy
+static struct cv *core_map_cv;
+
+// Next frame the eviction clock looks at
+static unsigned long clock_hand = 0;
+
+// Every user address space, linked through as_next, so that eviction
+// can find all the page table entries sharing a frame. Protected by
+// core_map_lock.
+static struct addrspace *all_addrspaces = NULL;
+
+// Free frames are kept by a buddy allocator: a free block of order k
+// is 2^k frames whose core-map index is a multiple of 2^k, and is on
+// free_lists[k] (linked through the core-map, -1 ends a list)
+#define BUDDY_MAX_ORDER 20
+static long free_lists[BUDDY_MAX_ORDER+1];
+static void buddy_free_range(unsigned long index, unsigned long count);
+
+static struct pagetable_entry *pagetable_lookup(struct addrspace *as, vaddr_t vaddr);
+
+// Per-CPU caches of free frames, so that most single-page kernel
+// allocations and frees do not need core_map_lock. The buddy allocator
+// counts cached frames as allocated. Caches are refilled from it and
+// drained back to it FRAME_CACHE_BATCH frames at a time.
+#define FRAME_CACHE_SIZE  16
+#define FRAME_CACHE_BATCH 8
+
+struct frame_cache {
+	struct spinlock fc_lock;
+	unsigned fc_count;
+	paddr_t fc_frames[FRAME_CACHE_SIZE];
+};
+
+static struct frame_cache frame_caches[MAXCPUS];
+
+// Frames zeroed ahead of time by zero_thread while the CPU has nothing
+// else to do, for pages that would otherwise be zeroed in vm_fault.
+// Like cached frames they count as allocated. zero_sem wakes the
+// thread up once the pool runs low; while other threads are running
+// it waits in thread_idle_wait for a CPU to go idle.
+#define ZERO_POOL_SIZE 8
+#define ZERO_POOL_LOW  4
+
+static struct spinlock zero_pool_lock = SPINLOCK_INITIALIZER;
+static unsigned zero_pool_count = 0;
+static paddr_t zero_pool[ZERO_POOL_SIZE];
+static struct semaphore *zero_sem;
+
+static void zero_thread(void *data1, unsigned long data2);
+
+// Dirty pages of shared mappings cannot be written back from inside the
+// frame allocator, so coremap_evict skips them and wakes clean_thread
+// through clean_sem instead. Once that has written them back they can
+// simply be dropped. clean_pending is set while a wakeup is outstanding,
+// and is protected by core_map_lock.
+static struct semaphore *clean_sem;
+static bool clean_pending = false;
+
+static void clean_thread(void *data1, unsigned long data2);
+
+// Frames holding read-only pages of executables, or pages of shared
+// file mappings, hashed on vnode and file offset and chained through
+// the core-map (-1 ends a chain). Processes running the same program,
+// or mapping the same file page shared at the same address, map these
+// instead of reading in a private copy. A frame leaves the cache when
+// it is freed or evicted.
+#define TEXT_CACHE_BUCKETS 64
+static long text_cache[TEXT_CACHE_BUCKETS];
+
+// Other CPUs V this once they have done a TLB shootdown
+static struct semaphore *tlbshootdown_sem;
+
+// ASID allocator. ASIDs are handed out in order and only reused once
+// they have all run out, which starts a new generation. A CPU flushes
+// its TLB before using any ASID of a generation newer than its TLB.
+// ASID 0 is never handed out.
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static unsigned asid_next = 1;
+static unsigned asid_generation = 1;
+
+// Generation each CPU's TLB was last flushed in
+static unsigned tlb_generation[MAXCPUS];
+
+// ASID each CPU's TLB lookups are currently tagged with
+static unsigned tlb_asid[MAXCPUS];
+
+// How tlb_load picks the entry to replace once every slot is valid
+#define TLB_POLICY_RANDOM     0 // let tlb_random pick
+#define TLB_POLICY_ROUNDROBIN 1 // replace slots in turn
+#define TLB_POLICY_CLOCK      2 // round-robin, but skip recently loaded slots once
+#define TLB_POLICY_COUNT      3
+
+static const char *const tlb_policy_names[TLB_POLICY_COUNT] = {
+	"random", "roundrobin", "clock",
+};
+static int tlb_policy = TLB_POLICY_CLOCK;
+
+// Per-CPU hand of the round-robin and clock policies, and the software
+// reference bits of the clock policy, set whenever a slot is loaded
+static unsigned tlb_hand[MAXCPUS];
+static bool tlb_referenced[MAXCPUS][NUM_TLB];
+
 // Total number of frames available
 static unsigned long num_of_frames = 0;
 
@@ -77,6 +188,15 @@ static paddr_t BASE;
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
 
+#if OPT_A3
+// The user stack starts out this many pages, and grows down on fault
+// up to stack_limit pages
+#define STACK_INITPAGES      1
+#define STACK_DEFAULTLIMIT   1024
+
+static unsigned stack_limit = STACK_DEFAULTLIMIT;
+#endif
+
 /*
  * Wrap rma_stealmem in a spinlock.
  */
@@ -98,6 +218,16 @@ vm_bootstrap(void)
 		}
 	} 
 
+	core_map_cv = cv_create("core_map_cv");
+	tlbshootdown_sem = sem_create("tlbshootdown_sem", 0);
+	zero_sem = sem_create("zero_sem", 0);
+	clean_sem = sem_create("clean_sem", 0);
+	if (core_map_cv == NULL || tlbshootdown_sem == NULL || zero_sem == NULL ||
+	    clean_sem == NULL) {
+		kprintf("fail to create core_map_cv/tlbshootdown_sem/zero_sem/clean_sem\n");
+		return;
+	}
+
 	lock_acquire(core_map_lock);
 
 	// spinlock_release(&stealmem_lock);
@@ -122,188 +252,1876 @@ vm_bootstrap(void)
 	for (unsigned long i = 0; i < num_of_frames; ++i) {
 		// Initialize each field of the coremap_entry structure
 		(core_map+i)->addr_base = BASE + PAGE_SIZE*i;
+		(core_map+i)->owner = NULL;
+		(core_map+i)->pte = NULL;
+		(core_map+i)->vaddr = 0;
+		(core_map+i)->referenced = false;
+		(core_map+i)->free_order = -1;
+		(core_map+i)->free_next = -1;
+		(core_map+i)->free_prev = -1;
+		(core_map+i)->tc_vnode = NULL;
+		(core_map+i)->tc_next = -1;
+
+		if (i < num_of_frame_core_map) { // mark as invalid since we stored core_map here
+			(core_map+i)->num_frame = 1;			
+			(core_map+i)->refcount = 1;
+		} else {
+			(core_map+i)->num_frame = 0;
+			(core_map+i)->refcount = 0;
+		}
+	}
+
+	// Everything after the core-map itself starts out free
+	for (int k = 0; k <= BUDDY_MAX_ORDER; ++k) {
+		free_lists[k] = -1;
+	}
+	for (int c = 0; c < MAXCPUS; ++c) {
+		spinlock_init(&frame_caches[c].fc_lock);
+		frame_caches[c].fc_count = 0;
+	}
+	for (int b = 0; b < TEXT_CACHE_BUCKETS; ++b) {
+		text_cache[b] = -1;
+	}
+	buddy_free_range(num_of_frame_core_map, num_of_frames - num_of_frame_core_map);
+
+	// We have initialized the vm system, so mark it as true
+	vm_init = true;
+
+	vmstats_init();
+
+	lock_release(core_map_lock);
+
+	// Needs kmalloc, so only now that the core-map is up
+	swap_bootstrap();
+
+	if (thread_fork("pagezero", NULL, zero_thread, NULL, 0)) {
+		kprintf("vm: could not start the page zeroing thread\n");
+	}
+	if (thread_fork("pageclean", NULL, clean_thread, NULL, 0)) {
+		kprintf("vm: could not start the page cleaning thread\n");
+	}
+
+#endif
+}
+
+#if OPT_A3
+
+static
+unsigned long
+frame_index(paddr_t paddr)
+{
+	KASSERT(0 == ((paddr - BASE)%PAGE_SIZE)); // must be a valid paddr
+
+	unsigned long index = (paddr - BASE)/PAGE_SIZE;
+
+	KASSERT(index < num_of_frames); // must be accessible in the core_map
+
+	return index;
+}
+
+static
+unsigned
+text_cache_hash(struct vnode *vn, off_t offset)
+{
+	return (((uintptr_t)vn >> 4) ^ (unsigned)(offset / PAGE_SIZE)) % TEXT_CACHE_BUCKETS;
+}
+
+/*
+ * Find a frame holding the page of VN that maps file offset OFFSET to
+ * its start and has bytes LO up to HI read from the file, as text or
+ * as a page of a shared mapping according to MAPPED. Its sharers must
+ * all map it at VADDR, eviction looks for them there. Lock must be
+ * held. Returns 0 if there is none.
+ */
+static
+paddr_t
+text_cache_lookup(struct vnode *vn, off_t offset, vaddr_t vaddr,
+		  unsigned lo, unsigned hi, bool mapped)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	for (long i = text_cache[text_cache_hash(vn, offset)]; i >= 0; i = (core_map+i)->tc_next) {
+		struct coremap_entry *e = core_map+i;
+		if (e->tc_vnode == vn && e->tc_offset == offset && e->vaddr == vaddr &&
+		    e->tc_lo == lo && e->tc_hi == hi && e->tc_mapped == mapped) {
+			return e->addr_base;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Enter the frame at PADDR into the text cache, unless another frame
+ * already holds the same page.
+ */
+static
+void
+text_cache_insert(paddr_t paddr, struct vnode *vn, off_t offset,
+		  unsigned lo, unsigned hi, bool mapped)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	struct coremap_entry *e = core_map+frame_index(paddr);
+
+	if (text_cache_lookup(vn, offset, e->vaddr, lo, hi, mapped) != 0) {
+		return;
+	}
+
+	KASSERT(e->tc_vnode == NULL);
+
+	unsigned b = text_cache_hash(vn, offset);
+	e->tc_vnode = vn;
+	e->tc_offset = offset;
+	e->tc_lo = lo;
+	e->tc_hi = hi;
+	e->tc_mapped = mapped;
+	e->tc_next = text_cache[b];
+	text_cache[b] = e - core_map;
+}
+
+/*
+ * Take the frame at core-map INDEX out of the text cache, if it is in.
+ */
+static
+void
+text_cache_remove(unsigned long index)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	struct coremap_entry *e = core_map+index;
+	if (e->tc_vnode == NULL) {
+		return;
+	}
+
+	long *link = &text_cache[text_cache_hash(e->tc_vnode, e->tc_offset)];
+	while (*link != (long)index) {
+		KASSERT(*link >= 0);
+		link = &(core_map+*link)->tc_next;
+	}
+	*link = e->tc_next;
+
+	e->tc_vnode = NULL;
+	e->tc_next = -1;
+}
+
+/*
+ * Invalidate every entry in this CPU's TLB.
+ */
+static
+void
+tlb_flush(void)
+{
+	int spl = splhigh();
+
+	for (int i = 0; i < NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+
+	// tlb_write clobbered the current ASID
+	tlb_setasid(tlb_asid[curcpu->c_number]);
+
+	splx(spl);
+
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+}
+
+/*
+ * Invalidate the translation for VADDR tagged with ASID in this CPU's
+ * TLB, if any.
+ */
+static
+void
+tlb_invalidate(vaddr_t vaddr, unsigned asid)
+{
+	int spl = splhigh();
+
+	int i = tlb_probe((vaddr & TLBHI_VPAGE) | (asid << TLBHI_PIDSHIFT), 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+
+	tlb_setasid(tlb_asid[curcpu->c_number]);
+
+	splx(spl);
+}
+
+/*
+ * Give AS an ASID from the current generation. Its translations still
+ * tagged with the old ASID can no longer be matched: that ASID is not
+ * handed out again before every CPU has flushed its TLB.
+ */
+static
+void
+asid_alloc(struct addrspace *as)
+{
+	KASSERT(spinlock_do_i_hold(&asid_lock));
+
+	if (asid_next == NUM_ASID) { // ran out, start a new generation
+		++asid_generation;
+		asid_next = 1;
+	}
+
+	as->as_asid = asid_next++;
+	as->as_asid_generation = asid_generation;
+	as->as_tlbcpus = 0;
+}
+
+/*
+ * Make this CPU's TLB lookups use AS's ASID, first giving AS a new
+ * one if NEWASID is set or its ASID is from an old generation. The
+ * TLB only needs flushing if the CPU has not done so since the last
+ * time the ASIDs ran out. Interrupts must be off.
+ */
+static
+void
+asid_activate(struct addrspace *as, bool newasid)
+{
+	unsigned cpu = curcpu->c_number;
+	bool flush;
+
+	spinlock_acquire(&asid_lock);
+
+	if (newasid || as->as_asid_generation != asid_generation) {
+		asid_alloc(as);
+	}
+
+	flush = (tlb_generation[cpu] != asid_generation);
+	tlb_generation[cpu] = asid_generation;
+
+	spinlock_release(&asid_lock);
+
+	tlb_asid[cpu] = as->as_asid;
+	as->as_tlbcpus |= (uint32_t)1 << cpu;
+
+	if (flush) {
+		tlb_flush();
+	} else {
+		tlb_setasid(as->as_asid);
+	}
+}
+
+/*
+ * Make every translation of AS that any CPU may still hold unusable,
+ * by giving it a new ASID.
+ */
+static
+void
+asid_retire(struct addrspace *as)
+{
+	int spl = splhigh();
+	if (as == curproc_getas()) {
+		asid_activate(as, true);
+	} else {
+		spinlock_acquire(&asid_lock);
+		asid_alloc(as);
+		spinlock_release(&asid_lock);
+	}
+	splx(spl);
+}
+
+/*
+ * Make sure no CPU still has a translation for VADDR in AS, and wait
+ * until they all have dropped it. Only CPUs that AS has been active on
+ * since it got its ASID can have one. Callers hold core_map_lock,
+ * which also makes sure only one shootdown is outstanding at a time.
+ */
+static
+void
+tlb_shootdown(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	ts.ts_addrspace = as;
+	ts.ts_vaddr = vaddr;
+	ts.ts_done = tlbshootdown_sem;
+
+	// Stay on this CPU until the IPIs are out
+	int spl = splhigh();
+
+	uint32_t self = (uint32_t)1 << curcpu->c_number;
+	uint32_t cpus = as->as_tlbcpus;
+
+	if (cpus & self) {
+		tlb_invalidate(vaddr, as->as_asid);
+	}
+
+	unsigned ncpus = 0;
+	if (cpus & ~self) {
+		ncpus = ipi_tlbshootdown_broadcast(&ts, cpus & ~self);
+	}
+
+	splx(spl);
+
+	for (unsigned i = 0; i < ncpus; ++i) {
+		P(tlbshootdown_sem);
+	}
+}
+
+static
+void
+freelist_insert(unsigned long index, int order)
+{
+	struct coremap_entry *e = core_map+index;
+
+	e->free_order = order;
+	e->free_prev = -1;
+	e->free_next = free_lists[order];
+	if (free_lists[order] >= 0) {
+		(core_map+free_lists[order])->free_prev = index;
+	}
+	free_lists[order] = index;
+}
+
+static
+void
+freelist_remove(unsigned long index)
+{
+	struct coremap_entry *e = core_map+index;
+
+	KASSERT(e->free_order >= 0);
+
+	if (e->free_prev >= 0) {
+		(core_map+e->free_prev)->free_next = e->free_next;
+	} else {
+		free_lists[e->free_order] = e->free_next;
+	}
+	if (e->free_next >= 0) {
+		(core_map+e->free_next)->free_prev = e->free_prev;
+	}
+	e->free_order = -1;
+}
+
+/*
+ * Put the free block of 2^ORDER frames at INDEX on the free lists,
+ * merging it with its buddy for as long as the buddy is free too.
+ */
+static
+void
+buddy_free_block(unsigned long index, int order)
+{
+	while (order < BUDDY_MAX_ORDER) {
+		unsigned long buddy = index ^ (1UL << order);
+
+		if (buddy >= num_of_frames || (core_map+buddy)->free_order != order) {
+			break;
+		}
+
+		freelist_remove(buddy);
+		if (buddy < index) {
+			index = buddy;
+		}
+		++order;
+	}
+
+	freelist_insert(index, order);
+}
+
+/*
+ * Free COUNT frames starting at INDEX, split into the largest aligned
+ * blocks that fit.
+ */
+static
+void
+buddy_free_range(unsigned long index, unsigned long count)
+{
+	while (count > 0) {
+		int order = 0;
+		while (order < BUDDY_MAX_ORDER &&
+		       (index & (1UL << order)) == 0 &&
+		       (2UL << order) <= count) {
+			++order;
+		}
+
+		buddy_free_block(index, order);
+		index += 1UL << order;
+		count -= 1UL << order;
+	}
+}
+
+/*
+ * Return the frames allocated together starting at PADDR to the
+ * core-map. Lock must be held.
+ */
+static
+void
+coremap_free(paddr_t paddr)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	unsigned long index = frame_index(paddr);
+
+	long frames_need_to_free = (core_map+index)->num_frame;
+
+	KASSERT(frames_need_to_free > 0);
+
+	text_cache_remove(index);
+
+	for (unsigned long i = index; i < index+frames_need_to_free; ++i) {
+		(core_map+i)->num_frame = 0;
+	}
+	buddy_free_range(index, frames_need_to_free);
+	(core_map+index)->refcount = 0;
+	(core_map+index)->owner = NULL;
+	(core_map+index)->pte = NULL;
+	(core_map+index)->referenced = false;
+}
+
+// What frame_evict_ptes does to the page table entries of a victim
+#define EVICT_BUSY     0 // keep everybody away while it is written out
+#define EVICT_DROP     1 // it is gone, read it in again on the next fault
+#define EVICT_SWAPPED  2 // it is in the swap slot now
+#define EVICT_ABORT    3 // it could not be written out, it stays
+
+/*
+ * Whether the page PTE maps in AS can be read in again as it is, so
+ * that it need not go to swap: text once the executable is loaded,
+ * and clean pages of mappings.
+ */
+static
+bool
+page_is_clean(struct addrspace *as, struct pagetable_entry *pte)
+{
+	if (pte->mapped) {
+		return !pte->dirty;
+	}
+	return pte->readonly && as->elf_loaded;
+}
+
+/*
+ * Have clean_thread write back the dirty pages of shared mappings, so
+ * that eviction can drop them. Lock must be held.
+ */
+static
+void
+clean_wakeup(void)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	if (!clean_pending) {
+		clean_pending = true;
+		V(clean_sem);
+	}
+}
+
+/*
+ * Find the page table entries sharing the frame E. They all map it at
+ * E->vaddr: fork keeps addresses, and the text cache only shares pages
+ * mapped at the same address. Returns true if all
+ * E->refcount of them were found and none is busy or a dirty page of
+ * a shared mapping; *CLEAN then tells whether every one of them can
+ * be read in again. Dirty pages of shared mappings wake clean_thread.
+ * Lock must be held.
+ */
+static
+bool
+frame_find_sharers(struct coremap_entry *e, bool *clean)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	unsigned found = 0;
+
+	*clean = true;
+	for (struct addrspace *as = all_addrspaces; as != NULL; as = as->as_next) {
+		struct pagetable_entry *pte = pagetable_lookup(as, e->vaddr);
+		if (pte == NULL || pte->addr_base != e->addr_base) {
+			continue;
+		}
+
+		if (pte->busy) {
+			return false;
+		}
+		if (pte->mapped && pte->dirty) {
+			clean_wakeup();
+			return false;
+		}
+		if (!page_is_clean(as, pte)) {
+			*clean = false;
+		}
+		++found;
+	}
+
+	return found == e->refcount;
+}
+
+/*
+ * Do HOW (one of EVICT_*) to the page table entry PTE, mapping the
+ * victim frame at VADDR in AS.
+ */
+static
+void
+frame_evict_pte(struct addrspace *as, struct pagetable_entry *pte, vaddr_t vaddr,
+		int how, unsigned slot)
+{
+	switch (how) {
+	    case EVICT_BUSY:
+		pte->busy = true;
+		tlb_shootdown(as, vaddr);
+		break;
+	    case EVICT_DROP:
+		tlb_shootdown(as, vaddr);
+		pte->addr_base = 0;
+		pte->cow = false;
+		break;
+	    case EVICT_SWAPPED:
+		pte->addr_base = 0;
+		pte->cow = false;
+		pte->swapped = true;
+		pte->swap_slot = slot;
+		pte->busy = false;
+		break;
+	    case EVICT_ABORT:
+		pte->busy = false;
+		break;
+	}
+}
+
+/*
+ * Do HOW to every page table entry mapping the victim frame E: just
+ * its owner's, or those of all its sharers. Lock must be held.
+ */
+static
+void
+frame_evict_ptes(struct coremap_entry *e, int how, unsigned slot)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	if (e->owner != NULL) {
+		frame_evict_pte(e->owner, e->pte, e->vaddr, how, slot);
+		return;
+	}
+
+	unsigned found = 0;
+	for (struct addrspace *as = all_addrspaces; as != NULL; as = as->as_next) {
+		struct pagetable_entry *pte = pagetable_lookup(as, e->vaddr);
+		if (pte != NULL && pte->addr_base == e->addr_base) {
+			frame_evict_pte(as, pte, e->vaddr, how, slot);
+			++found;
+		}
+	}
+	KASSERT(found == e->refcount);
+}
+
+/*
+ * Take a user page out of memory and hand its frame to the caller.
+ * Victims are picked with the clock algorithm: frames used since the
+ * hand last passed get a second chance. Frames shared copy-on-write,
+ * as text or by a shared mapping are taken from all their sharers at once, found by
+ * looking at the same address in every address space.
+ *
+ * Pages that can be read in again as they are, text and clean pages
+ * of mappings, are simply dropped. Anything else is written to swap,
+ * once, and its sharers all refer to the same slot.
+ *
+ * Pages of shared mappings are never written back from here: this
+ * runs inside the frame allocator, possibly under kmalloc with
+ * filesystem locks held, and writing to the file would take them
+ * again. Dirty ones are skipped, and clean_thread is woken to write
+ * them back so that they can be dropped on a later pass.
+ *
+ * Lock must be held; it is dropped while a page is written to swap.
+ * Returns 0 if nothing could be evicted.
+ */
+static
+paddr_t
+coremap_evict(void)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	struct coremap_entry *victim = NULL;
+	bool clean = false;
+
+	// Two sweeps are enough to find a frame whose referenced bit we cleared
+	for (unsigned long n = 0; n < 2*num_of_frames; ++n) {
+		struct coremap_entry *e = core_map+clock_hand;
+		clock_hand = (clock_hand + 1) % num_of_frames;
+
+		// Only user frames have an owner or are shared
+		if (e->owner == NULL && e->refcount < 2) {
+			continue;
+		}
+		if (e->owner != NULL && e->pte->busy) {
+			continue;
+		}
+		if (e->owner != NULL && e->pte->mapped && e->pte->dirty) {
+			clean_wakeup();
+			continue;
+		}
+
+		if (e->referenced) {
+			e->referenced = false;
+			continue;
+		}
+
+		if (e->owner != NULL) {
+			clean = page_is_clean(e->owner, e->pte);
+		} else if (!frame_find_sharers(e, &clean)) {
+			continue;
+		}
+
+		victim = e;
+		break;
+	}
+
+	if (victim == NULL) {
+		return 0;
+	}
+
+	KASSERT(1 == victim->num_frame);
+	KASSERT(victim->owner == NULL || victim->pte->addr_base == victim->addr_base);
+	KASSERT(victim->owner == NULL || !victim->pte->cow);
+
+	// Nobody else may start sharing the frame while it is written out
+	text_cache_remove(victim - core_map);
+
+	if (clean) {
+		// Its TLB entries never allowed writes, nothing to save
+		frame_evict_ptes(victim, EVICT_DROP, 0);
+	} else {
+		unsigned slot;
+
+		if (swap_alloc(&slot)) {
+			return 0;
+		}
+		for (unsigned i = 1; i < victim->refcount; ++i) {
+			swap_incref(slot);
+		}
+
+		// Keep the sharers away from the page, and stop them writing to it
+		frame_evict_ptes(victim, EVICT_BUSY, 0);
+
+		lock_release(core_map_lock);
+		int result = swap_write(slot, victim->addr_base);
+		lock_acquire(core_map_lock);
+
+		if (result) {
+			frame_evict_ptes(victim, EVICT_ABORT, 0);
+			for (unsigned i = 0; i < victim->refcount; ++i) {
+				swap_free(slot);
+			}
+			cv_broadcast(core_map_cv, core_map_lock);
+			return 0;
+		}
+
+		frame_evict_ptes(victim, EVICT_SWAPPED, slot);
+		cv_broadcast(core_map_cv, core_map_lock);
+	}
+
+	// Nobody refers to the frame any more, it now belongs to the caller
+	victim->refcount = 1;
+	victim->owner = NULL;
+	victim->pte = NULL;
+	victim->referenced = false;
+
+	return victim->addr_base;
+}
+
+/*
+ * Take NPAGES contiguous frames off the buddy free lists. Lock must be
+ * held. Returns 0 if there is no free block large enough.
+ */
+static
+paddr_t
+buddy_alloc(unsigned long npages)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+	KASSERT(npages > 0);
+
+	// Smallest block that fits
+	int order = 0;
+	while (order <= BUDDY_MAX_ORDER && (1UL << order) < npages) {
+		++order;
+	}
+
+	int k = order;
+	while (k <= BUDDY_MAX_ORDER && free_lists[k] < 0) {
+		++k;
+	}
+
+	if (k > BUDDY_MAX_ORDER) {
+		return 0;
+	}
+
+	unsigned long first = free_lists[k];
+	freelist_remove(first);
+
+	// Split down to the size we need, the upper halves stay free
+	while (k > order) {
+		--k;
+		freelist_insert(first + (1UL << k), k);
+	}
+
+	// Give back what the rounding up to a power of two took too much
+	buddy_free_range(first + npages, (1UL << order) - npages);
+
+	(core_map+first)->num_frame = npages; // mark the first frame as the npages
+	(core_map+first)->refcount = 1; // only the caller refers to it so far
+	(core_map+first)->owner = NULL;
+	(core_map+first)->pte = NULL;
+	(core_map+first)->referenced = false;
+
+	for (unsigned long i = first+1; i < first+npages; ++i) {
+		(core_map+i)->num_frame = -1; // update following frames
+	}
+
+	return (core_map+first)->addr_base;
+}
+
+/*
+ * Give every frame sitting in a per-CPU cache or the zero pool back to
+ * the buddy allocator. Lock must be held. Returns the number of frames
+ * freed.
+ */
+static
+unsigned
+frame_cache_reclaim(void)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	unsigned total = 0;
+
+	for (int c = 0; c < MAXCPUS; ++c) {
+		struct frame_cache *fc = &frame_caches[c];
+
+		spinlock_acquire(&fc->fc_lock);
+		if (fc->fc_count > 0) {
+			vmstats_inc(VMSTAT_FRAME_CACHE_DRAIN);
+		}
+		while (fc->fc_count > 0) {
+			coremap_free(fc->fc_frames[--fc->fc_count]);
+			++total;
+		}
+		spinlock_release(&fc->fc_lock);
+	}
+
+	spinlock_acquire(&zero_pool_lock);
+	while (zero_pool_count > 0) {
+		coremap_free(zero_pool[--zero_pool_count]);
+		++total;
+	}
+	spinlock_release(&zero_pool_lock);
+
+	return total;
+}
+
+/*
+ * Find NPAGES contiguous free frames. When memory is short the
+ * per-CPU caches are emptied first, and then a single frame may come
+ * from evicting a user page. Lock must be held, but may be dropped and
+ * reacquired. Returns 0 if out of memory.
+ */
+static
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	paddr_t addr = buddy_alloc(npages);
+
+	if (addr == 0 && frame_cache_reclaim() > 0) {
+		addr = buddy_alloc(npages);
+	}
+
+	if (addr == 0 && 1 == npages) {
+		addr = coremap_evict();
+	}
+
+	return addr;
+}
+
+/*
+ * Take a frame from this CPU's cache without touching core_map_lock.
+ * Returns 0 if the cache is empty.
+ */
+static
+paddr_t
+frame_cache_get(void)
+{
+	paddr_t addr = 0;
+
+	struct frame_cache *fc = &frame_caches[curcpu->c_number];
+
+	spinlock_acquire(&fc->fc_lock);
+	if (fc->fc_count > 0) {
+		addr = fc->fc_frames[--fc->fc_count];
+	}
+	spinlock_release(&fc->fc_lock);
+
+	if (addr != 0) {
+		// Nobody else looks at a cached frame, no need for the lock
+		struct coremap_entry *e = core_map+frame_index(addr);
+		KASSERT(1 == e->num_frame && 0 == e->refcount);
+		e->refcount = 1;
+	}
+
+	return addr;
+}
+
+/*
+ * Put the single frame ADDR in this CPU's cache. Returns false if the
+ * cache is full.
+ */
+static
+bool
+frame_cache_put(paddr_t addr)
+{
+	bool done = false;
+
+	struct coremap_entry *e = core_map+frame_index(addr);
+	KASSERT(1 == e->num_frame);
+	e->refcount = 0;
+	e->owner = NULL;
+	e->pte = NULL;
+	e->referenced = false;
+
+	// The cache may belong to another CPU by the time we lock it if we
+	// are preempted in between, which is harmless
+	struct frame_cache *fc = &frame_caches[curcpu->c_number];
+
+	spinlock_acquire(&fc->fc_lock);
+	if (fc->fc_count < FRAME_CACHE_SIZE) {
+		fc->fc_frames[fc->fc_count++] = addr;
+		done = true;
+	}
+	spinlock_release(&fc->fc_lock);
+
+	return done;
+}
+
+/*
+ * Top up this CPU's cache from the buddy allocator, without evicting
+ * anything for it. Lock must be held.
+ */
+static
+void
+frame_cache_refill(void)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	struct frame_cache *fc = &frame_caches[curcpu->c_number];
+
+	spinlock_acquire(&fc->fc_lock);
+
+	unsigned n = 0;
+	while (n < FRAME_CACHE_BATCH && fc->fc_count < FRAME_CACHE_SIZE) {
+		paddr_t addr = buddy_alloc(1);
+		if (addr == 0) {
+			break;
+		}
+		(core_map+frame_index(addr))->refcount = 0;
+		fc->fc_frames[fc->fc_count++] = addr;
+		++n;
+	}
+	spinlock_release(&fc->fc_lock);
+
+	if (n > 0) {
+		vmstats_inc(VMSTAT_FRAME_CACHE_REFILL);
+	}
+}
+
+/*
+ * Called with this CPU's cache full: hand FRAME_CACHE_BATCH frames of
+ * it back to the buddy allocator, along with ADDR. Lock must be held.
+ */
+static
+void
+frame_cache_drain(paddr_t addr)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	struct frame_cache *fc = &frame_caches[curcpu->c_number];
+
+	spinlock_acquire(&fc->fc_lock);
+	for (unsigned n = 0; n < FRAME_CACHE_BATCH && fc->fc_count > 0; ++n) {
+		coremap_free(fc->fc_frames[--fc->fc_count]);
+	}
+	spinlock_release(&fc->fc_lock);
+
+	coremap_free(addr);
+
+	vmstats_inc(VMSTAT_FRAME_CACHE_DRAIN);
+}
+
+/*
+ * Take an already zeroed frame from the pool, or return 0 if it is
+ * empty. Wakes up zero_thread when the pool runs low.
+ */
+static
+paddr_t
+zero_pool_get(void)
+{
+	paddr_t addr = 0;
+	bool low;
+
+	spinlock_acquire(&zero_pool_lock);
+	if (zero_pool_count > 0) {
+		addr = zero_pool[--zero_pool_count];
+	}
+	low = (zero_pool_count < ZERO_POOL_LOW);
+	spinlock_release(&zero_pool_lock);
+
+	if (low) {
+		V(zero_sem);
+	}
+
+	if (addr != 0) {
+		struct coremap_entry *e = core_map+frame_index(addr);
+		KASSERT(1 == e->num_frame && 0 == e->refcount);
+		e->refcount = 1;
+	}
+
+	return addr;
+}
+
+/*
+ * Keep the zero pool topped up, using only time the CPU would
+ * otherwise spend idle: whenever another thread wants to run, sleep
+ * until a CPU runs out of work. Never evicts anything to get a frame.
+ */
+static
+void
+zero_thread(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	for (;;) {
+		spinlock_acquire(&zero_pool_lock);
+		bool full = (zero_pool_count == ZERO_POOL_SIZE);
+		spinlock_release(&zero_pool_lock);
+
+		if (full) {
+			P(zero_sem);
+			continue;
+		}
+
+		if (thread_cpu_busy()) {
+			thread_idle_wait();
+			continue;
+		}
+
+		lock_acquire(core_map_lock);
+		paddr_t addr = buddy_alloc(1);
+		if (addr != 0) {
+			(core_map+frame_index(addr))->refcount = 0;
+		}
+		lock_release(core_map_lock);
+
+		if (addr == 0) { // memory is tight, try again once a frame is taken
+			P(zero_sem);
+			continue;
+		}
+
+		bzero((void *)PADDR_TO_KVADDR(addr), PAGE_SIZE);
+
+		spinlock_acquire(&zero_pool_lock);
+		if (zero_pool_count < ZERO_POOL_SIZE) {
+			zero_pool[zero_pool_count++] = addr;
+			addr = 0;
+		}
+		spinlock_release(&zero_pool_lock);
+
+		if (addr != 0) { // reclaimed and refilled meanwhile
+			lock_acquire(core_map_lock);
+			coremap_free(addr);
+			lock_release(core_map_lock);
+		}
+	}
+}
+
+#endif
+
+static
+paddr_t
+getppages(unsigned long npages)
+{
+	paddr_t addr;
+
+	// spinlock_acquire(&stealmem_lock);
+		
+#if OPT_A3
+
+	(void)stealmem_lock;
+
+	// spinlock_release(&stealmem_lock);
+
+	if (vm_init) { // our vm system has been initialized, need to take over memory management
+
+		addr = 0;
+		if (1 == npages) {
+			addr = frame_cache_get();
+		}
+
+		if (addr == 0) {
+			lock_acquire(core_map_lock);
+			addr = coremap_alloc(npages);
+			if (addr != 0 && 1 == npages) {
+				frame_cache_refill();
+			}
+			lock_release(core_map_lock);
+		}
+
+		if (addr == 0) {
+			DEBUG(DB_VM, "dumbvm: out of memory allocating %lu pages\n", npages);
+		}
+	
+	} else {
+		addr = ram_stealmem(npages);
+	}
+
+
+#endif	
+
+	// spinlock_release(&stealmem_lock);
+	
+	return addr;
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+	pa = getppages(npages);
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void 
+free_kpages(vaddr_t addr)
+{
+	/* nothing - leak the memory. */
+
+	// (void)addr;
+
+#if OPT_A3
+
+	paddr_t paddr = addr - MIPS_KSEG0;
+
+	// The block is ours, so num_frame can be read without the lock
+	if (1 == (core_map+frame_index(paddr))->num_frame && frame_cache_put(paddr)) {
+		return;
+	}
+
+	lock_acquire(core_map_lock);
+	if (1 == (core_map+frame_index(paddr))->num_frame) {
+		frame_cache_drain(paddr);
+	} else {
+		coremap_free(paddr);
+	}
+	lock_release(core_map_lock);
+
+#endif
+
+}
+
+#if OPT_A3
+
+/*
+ * Reference counting for user frames shared copy-on-write between
+ * address spaces. A frame is returned to the core-map only when the
+ * last page table entry referring to it goes away.
+ *
+ * All of the helpers below expect core_map_lock to be held.
+ */
+static
+void
+frame_incref(paddr_t paddr)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	struct coremap_entry *e = core_map+frame_index(paddr);
+	KASSERT(1 == e->num_frame); // user pages are always single frames
+	KASSERT(e->refcount > 0);
+	++e->refcount;
+
+	// The old owner is sharing now too, so it can take the frame back
+	// in frame_touch once the others are gone. Pages of shared mappings
+	// stay writable, all sharers are meant to see each other's writes.
+	if (e->pte != NULL && !e->pte->mapped) {
+		e->pte->cow = true;
+	}
+
+	// Shared frames have no single owner, eviction looks for every sharer
+	e->owner = NULL;
+	e->pte = NULL;
+}
+
+static
+void
+frame_decref(paddr_t paddr)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	struct coremap_entry *e = core_map+frame_index(paddr);
+	KASSERT(1 == e->num_frame);
+	KASSERT(e->refcount > 0);
+
+	if (1 == e->refcount) { // last reference, give it back
+		coremap_free(paddr);
+	} else {
+		--e->refcount;
+	}
+}
+
+/*
+ * Record that PTE, mapping VADDR in AS, is the only user of its frame,
+ * which makes the frame a candidate for eviction.
+ */
+static
+void
+frame_set_owner(struct addrspace *as, struct pagetable_entry *pte, vaddr_t vaddr)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	struct coremap_entry *e = core_map+frame_index(pte->addr_base);
+	KASSERT(1 == e->refcount);
+
+	e->owner = as;
+	e->pte = pte;
+	e->vaddr = vaddr;
+	e->referenced = true;
+}
+
+/*
+ * Called on every TLB load of PTE's page.
+ */
+static
+void
+frame_touch(struct addrspace *as, struct pagetable_entry *pte, vaddr_t vaddr)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	struct coremap_entry *e = core_map+frame_index(pte->addr_base);
+
+	if (e->owner == NULL && 1 == e->refcount) {
+		// The other sharers have gone away already, the page is ours now
+		pte->cow = false;
+		frame_set_owner(as, pte, vaddr);
+	}
+
+	e->referenced = true;
+}
+
+/*
+ * Give PTE a private copy of its frame so that it can be written.
+ * If nobody else shares the frame any more, just take it over.
+ */
+static
+int
+frame_break_cow(struct addrspace *as, struct pagetable_entry *pte, vaddr_t vaddr)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+	KASSERT(pte->cow);
+	KASSERT(!pte->mapped);
+
+	paddr_t old_paddr = pte->addr_base;
+
+	if (1 == (core_map+frame_index(old_paddr))->refcount) {
+		pte->cow = false;
+		frame_set_owner(as, pte, vaddr);
+		return 0;
+	}
+
+	// coremap_alloc may drop the lock to evict something
+	pte->busy = true;
+	paddr_t new_paddr = coremap_alloc(1);
+	if (new_paddr == 0) {
+		pte->busy = false;
+		cv_broadcast(core_map_cv, core_map_lock);
+		return ENOMEM;
+	}
+
+	memmove((void *)PADDR_TO_KVADDR(new_paddr),
+		(const void *)PADDR_TO_KVADDR(old_paddr),
+		PAGE_SIZE);
+
+	frame_decref(old_paddr);
+
+	pte->addr_base = new_paddr;
+	pte->cow = false;
+	pte->busy = false;
+	cv_broadcast(core_map_cv, core_map_lock);
+
+	frame_set_owner(as, pte, vaddr);
+
+	return 0;
+}
+
+/*
+ * Allocate a second-level page table, none of its pages backed by a
+ * frame yet. Must not be called with core_map_lock held.
+ */
+static
+struct pagetable_entry *
+pagetable_create(void)
+{
+	struct pagetable_entry *pt = kmalloc(sizeof(struct pagetable_entry)*PT_L2_ENTRIES);
+	if (pt == NULL) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < PT_L2_ENTRIES; ++i) {
+		(pt+i)->addr_base = 0;
+		(pt+i)->cow = false;
+		(pt+i)->busy = false;
+		(pt+i)->swapped = false;
+		(pt+i)->readonly = false;
+		(pt+i)->mapped = false;
+		(pt+i)->dirty = false;
+		(pt+i)->swap_slot = 0;
+	}
+
+	return pt;
+}
+
+/*
+ * Page table entry for VADDR in AS, or NULL if no page near it has
+ * been touched yet.
+ */
+static
+struct pagetable_entry *
+pagetable_lookup(struct addrspace *as, vaddr_t vaddr)
+{
+	KASSERT(vaddr < USERSPACETOP);
+
+	struct pagetable_entry *pt = as->as_pagetable[PT_L1_INDEX(vaddr)];
+	if (pt == NULL) {
+		return NULL;
+	}
+
+	return pt+PT_L2_INDEX(vaddr);
+}
+
+/*
+ * Like pagetable_lookup, but creates the second-level table if needed.
+ * Only the thread running in AS changes its tables, so no lock is
+ * needed, but core_map_lock must not be held. Returns NULL if out of
+ * memory.
+ */
+static
+struct pagetable_entry *
+pagetable_get(struct addrspace *as, vaddr_t vaddr)
+{
+	KASSERT(vaddr < USERSPACETOP);
+
+	struct pagetable_entry **l1 = &as->as_pagetable[PT_L1_INDEX(vaddr)];
+	if (*l1 == NULL) {
+		*l1 = pagetable_create();
+		if (*l1 == NULL) {
+			return NULL;
+		}
+	}
+
+	return (*l1)+PT_L2_INDEX(vaddr);
+}
+
+/*
+ * Region of AS that VADDR falls into, or NULL if it is not a valid
+ * user address.
+ */
+static
+struct region *
+region_find(struct addrspace *as, vaddr_t vaddr)
+{
+	for (struct region *rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (vaddr >= rg->rg_vbase && vaddr - rg->rg_vbase < rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The most recently defined region of AS, whose base is VBASE.
+ */
+static
+struct region *
+region_find_base(struct addrspace *as, vaddr_t vbase)
+{
+	struct region *found = NULL;
+
+	for (struct region *rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_vbase == vbase) {
+			found = rg;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Called for a fault at VADDR outside every region: if it is below the
+ * stack but within stack_limit pages of USERSTACK, grow the stack down
+ * to cover it, unless that would run into another region. Returns the
+ * stack region, or NULL if VADDR is invalid after all.
+ */
+static
+struct region *
+stack_grow(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *stack = as->as_stack;
+
+	if (stack == NULL || vaddr >= stack->rg_vbase ||
+	    vaddr < USERSTACK - stack_limit * PAGE_SIZE) {
+		return NULL;
+	}
+
+	vaddr_t newbase = vaddr & PAGE_FRAME;
+
+	for (struct region *rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg != stack && rg->rg_vbase < stack->rg_vbase &&
+		    rg->rg_vbase + rg->rg_npages * PAGE_SIZE > newbase) {
+			return NULL;
+		}
+	}
+
+	stack->rg_npages += (stack->rg_vbase - newbase) / PAGE_SIZE;
+	stack->rg_vbase = newbase;
+	stack->rg_source.vaddr = newbase;
+
+	return stack;
+}
+
+/*
+ * Region a fault at VADDR should be served from, growing the stack if
+ * need be. NULL if VADDR is not a valid user address.
+ */
+static
+struct region *
+region_fault(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg = region_find(as, vaddr);
+	if (rg == NULL) {
+		rg = stack_grow(as, vaddr);
+	}
+
+	return rg;
+}
+
+/*
+ * Make DST map the same frames and swap slots as SRC, and mark both
+ * copy-on-write. Pages of shared mappings are shared as they are, so
+ * that writes on either side reach the other.
+ */
+static
+void
+pagetable_share(struct pagetable_entry *dst, struct pagetable_entry *src, size_t npages)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	for (size_t i = 0; i < npages; ++i) {
+		while ((src+i)->busy) {
+			cv_wait(core_map_cv, core_map_lock);
+		}
+
+		if ((src+i)->addr_base != 0) {
+			frame_incref((src+i)->addr_base);
+			if (!(src+i)->mapped) {
+				(src+i)->cow = true;
+			}
+		} else if ((src+i)->swapped) {
+			swap_incref((src+i)->swap_slot);
+		}
+
+		*(dst+i) = *(src+i);
+
+		// Changes made so far are the parent's to write back
+		(dst+i)->dirty = false;
+	}
+}
+
+/*
+ * Drop every frame and swap slot referred to by a page table.
+ */
+static
+void
+pagetable_release(struct pagetable_entry *pt, size_t npages)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+
+	if (pt == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < npages; ++i) {
+		while ((pt+i)->busy) {
+			cv_wait(core_map_cv, core_map_lock);
+		}
+
+		// Frames may still be shared with a parent/child, only drop our reference
+		if ((pt+i)->addr_base != 0) {
+			frame_decref((pt+i)->addr_base);
+			(pt+i)->addr_base = 0;
+		} else if ((pt+i)->swapped) {
+			swap_free((pt+i)->swap_slot);
+			(pt+i)->swapped = false;
+		}
+	}
+}
+
+/*
+ * Back PTE with a frame when the page at VADDR is touched and not in
+ * memory. The contents come from swap if the page was evicted before.
+ * Otherwise whatever part of the page RG's source says comes from the
+ * executable, or from the mapped file, is read in and the rest is left
+ * zeroed. RG may be NULL for pages that are in swap. Read-only pages
+ * of a loaded executable, and pages of shared mappings, are shared
+ * with other processes that have the same page in memory already.
+ *
+ * core_map_lock must be held; it is dropped during the disk I/O.
+ */
+static
+int
+page_in(struct addrspace *as, struct region *rg,
+	struct pagetable_entry *pte, vaddr_t vaddr)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+	KASSERT(pte->addr_base == 0);
+	KASSERT(!pte->busy);
+
+	int result = 0;
+
+	struct segment_source *src = (rg == NULL) ? NULL : &rg->rg_source;
+	struct vnode *vn = (rg != NULL && rg->rg_file != NULL) ? rg->rg_file : as->as_vnode;
+	bool mapping = (rg != NULL && rg->rg_file != NULL);
+
+	// Part of this page that is backed by the file
+	vaddr_t start = vaddr;
+	vaddr_t end = vaddr + PAGE_SIZE;
+
+	if (src != NULL) {
+		if (start < src->vaddr) {
+			start = src->vaddr;
+		}
+		if (end > src->vaddr + src->filesize) {
+			end = src->vaddr + src->filesize;
+		}
+	}
+
+	bool fromfile = (src != NULL && vn != NULL && start < end);
+
+	// Everything not read from swap or the file must be zero. Reads of
+	// a mapping stop short at the end of the file.
+	bool needzero = !pte->swapped && !(fromfile && !mapping && end - start == PAGE_SIZE);
+
+	// Text never changes once loaded, so one copy can serve everybody.
+	// A shared mapping must have only one copy, or writes through one
+	// would not be seen through another.
+	bool shareable = fromfile && !pte->swapped &&
+		(pte->mapped || (!mapping && pte->readonly && as->elf_loaded));
+	off_t fileoff = 0;
+
+	if (shareable) {
+		fileoff = src->offset + ((off_t)vaddr - (off_t)src->vaddr);
+
+		paddr_t shared = text_cache_lookup(vn, fileoff, vaddr, start - vaddr,
+						   end - vaddr, pte->mapped);
+		if (shared != 0) {
+			frame_incref(shared);
+			pte->addr_base = shared;
+			pte->cow = !pte->mapped;
+			// No I/O needed, as far as the statistics go this is a reload
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+			vmstats_inc(VMSTAT_TEXT_SHARED);
+			return 0;
+		}
+	}
+
+	pte->busy = true;
+
+	paddr_t paddr = 0;
+	if (needzero) {
+		paddr = zero_pool_get();
+		if (paddr != 0) {
+			needzero = false;
+		}
+	}
+	if (paddr == 0) {
+		paddr = coremap_alloc(1);
+	}
+	if (paddr == 0) {
+		pte->busy = false;
+		cv_broadcast(core_map_cv, core_map_lock);
+		return ENOMEM;
+	}
+
+	lock_release(core_map_lock);
+
+	if (pte->swapped) {
+		result = swap_read(pte->swap_slot, paddr);
+		if (result == 0) {
+			vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		}
+	} else {
+		if (needzero) {
+			bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+		}
 
-		if (i < num_of_frame_core_map) { // mark as invalid since we stored core_map here
-			(core_map+i)->num_frame = 1;			
+		if (fromfile) {
+			struct iovec iov;
+			struct uio u;
+
+			uio_kinit(&iov, &u, (void *)(PADDR_TO_KVADDR(paddr) + (start - vaddr)),
+				  end - start, src->offset + (start - src->vaddr), UIO_READ);
+
+			result = VOP_READ(vn, &u);
+			if (result == 0 && u.uio_resid != 0 && !mapping) {
+				/* short read; problem with executable? */
+				kprintf("ELF: short read on segment - file truncated?\n");
+				result = ENOEXEC;
+			}
+			if (result == 0) {
+				vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+				vmstats_inc(VMSTAT_ELF_FILE_READ);
+			}
 		} else {
-			(core_map+i)->num_frame = 0;
+			vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
 		}
 	}
 
-	// We have initialized the vm system, so mark it as true
-	vm_init = true;
+	lock_acquire(core_map_lock);
 
-	lock_release(core_map_lock);
+	if (result) {
+		coremap_free(paddr);
+		pte->busy = false;
+		cv_broadcast(core_map_cv, core_map_lock);
+		return result;
+	}
 
-#endif	
-}
+	if (pte->swapped) {
+		swap_free(pte->swap_slot);
+		pte->swapped = false;
+	}
 
-static
-paddr_t
-getppages(unsigned long npages)
-{
-	paddr_t addr;
+	// Another sharer of the mapping may have read the same page in
+	// while the lock was dropped, there must be only one copy
+	paddr_t shared = 0;
+	if (shareable && pte->mapped) {
+		shared = text_cache_lookup(vn, fileoff, vaddr, start - vaddr,
+					   end - vaddr, true);
+	}
+	if (shared != 0) {
+		coremap_free(paddr);
+		frame_incref(shared);
+		paddr = shared;
+	}
 
-	// spinlock_acquire(&stealmem_lock);
-		
-#if OPT_A3
+	pte->addr_base = paddr;
+	pte->cow = false;
+	pte->busy = false;
+	cv_broadcast(core_map_cv, core_map_lock);
 
-	(void)stealmem_lock;
+	if (shared != 0) {
+		return 0;
+	}
 
-	// spinlock_release(&stealmem_lock);
+	frame_set_owner(as, pte, vaddr);
 
-	if (vm_init) { // our vm system has been initialized, need to take over memory management
+	if (shareable) {
+		text_cache_insert(paddr, vn, fileoff, start - vaddr, end - vaddr, pte->mapped);
+	}
 
-		if (core_map_lock == NULL) {
-			core_map_lock = lock_create("core_map_lock");
-			if (core_map_lock == NULL) {
-				kprintf("fail to create core_map_lock\n");
-				return -1;
-			}
-		}
+	return 0;
+}
 
-		lock_acquire(core_map_lock);
+/*
+ * Write the page at VADDR of mapping RG, held in the frame at PADDR,
+ * back to the file. Only the part that is both mapped and inside the
+ * file is written, mappings never make a file grow. Called without
+ * core_map_lock, the page must be kept busy.
+ */
+static
+int
+mapping_writeback(struct region *rg, vaddr_t vaddr, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio u;
+	struct stat st;
 
-		unsigned long count = npages;
+	size_t skip = vaddr - rg->rg_vbase;
+	off_t offset = rg->rg_source.offset + skip;
+	size_t len = PAGE_SIZE;
 
-		for (unsigned long i = 0; i < num_of_frames; ++i) {			
+	if (skip >= rg->rg_source.filesize) {
+		return 0;
+	}
+	if (skip + len > rg->rg_source.filesize) {
+		len = rg->rg_source.filesize - skip;
+	}
 
-			if (0 == (core_map+i)->num_frame) { // found an unused frame
+	int result = VOP_STAT(rg->rg_file, &st);
+	if (result) {
+		return result;
+	}
+	if (offset >= st.st_size) {
+		return 0;
+	}
+	if (offset + (off_t)len > st.st_size) {
+		len = st.st_size - offset;
+	}
 
-				--count;
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), len, offset, UIO_WRITE);
+	return VOP_WRITE(rg->rg_file, &u);
+}
 
-				for (unsigned long j = i+1; j < i+npages; ++j) {
+/*
+ * Write the dirty page PTE, at VADDR of shared mapping RG in AS, back
+ * to the file. Its writable translation is dropped, so that the next
+ * write marks it dirty again. The page is kept busy meanwhile, which
+ * holds off eviction, and munmap or as_destroy freeing AS or RG.
+ *
+ * core_map_lock must be held; it is dropped during the write.
+ */
+static
+int
+mapping_clean_page(struct addrspace *as, struct region *rg,
+		   struct pagetable_entry *pte, vaddr_t vaddr)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
+	KASSERT(!pte->busy && pte->addr_base != 0 && pte->dirty);
 
-					if (0 == count) { // found it
-						break;
-					}
+	pte->busy = true;
+	pte->dirty = false;
+	tlb_shootdown(as, vaddr);
+	paddr_t paddr = pte->addr_base;
 
-					if (0 != (core_map+j)->num_frame) { // not enough contiguous memory to alloc
-						i = j+i; // go to next "might available" frame to check
-						count = npages; // reset the counter
-						break;
-					}
+	lock_release(core_map_lock);
+	int result = mapping_writeback(rg, vaddr, paddr);
+	lock_acquire(core_map_lock);
 
-					--count;
-				}
-			}
+	if (result) {
+		pte->dirty = true;
+	}
+	pte->busy = false;
+	cv_broadcast(core_map_cv, core_map_lock);
 
-			if (0 == count) { // found feasible contiguous memory
-				
-				(core_map+i)->num_frame = npages; // mark the first frame as the npages
-				addr = (core_map+i)->addr_base; // set the return addr to be the corresponding paddr
+	return result;
+}
 
-				for (unsigned long k = i+1; k < i+npages; ++k) {
-					(core_map+k)->num_frame = -1; // update following frames
-				}	
+/*
+ * Find a dirty page of a shared mapping in any address space. Lock
+ * must be held. Returns NULL if there is none.
+ */
+static
+struct pagetable_entry *
+mapping_find_dirty(struct addrspace **asret, struct region **rgret, vaddr_t *vaddrret)
+{
+	KASSERT(lock_do_i_hold(core_map_lock));
 
-				break;
+	for (struct addrspace *as = all_addrspaces; as != NULL; as = as->as_next) {
+		for (struct region *rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+			if (rg->rg_file == NULL || !rg->rg_shared) {
+				continue;
 			}
 
+			for (size_t i = 0; i < rg->rg_npages; ++i) {
+				vaddr_t vaddr = rg->rg_vbase + i * PAGE_SIZE;
+				struct pagetable_entry *pte = pagetable_lookup(as, vaddr);
+				if (pte != NULL && !pte->busy && pte->addr_base != 0 && pte->dirty) {
+					*asret = as;
+					*rgret = rg;
+					*vaddrret = vaddr;
+					return pte;
+				}
+			}
 		}
+	}
 
-/*
-// Trace the core_map entry
-for (unsigned long i = 0; i < num_of_frames; ++i) {
-	kprintf("%ld ",(core_map+i)->num_frame);
+	return NULL;
 }
-kprintf("\n");
-kprintf("\n");
-kprintf("\n");
-*/
-		if (count > 0) { // no enough memory
-			kprintf("SHOULD NOT COME HERE\n");
-			panic("OUT OF MEMORY!!!!!\n");
-		}
 
-		lock_release(core_map_lock);
-	
-	} else {
-		addr = ram_stealmem(npages);
-	}
+/*
+ * Write back dirty pages of shared mappings whenever eviction finds
+ * them in its way. Runs in its own thread so that the file system is
+ * entered without any of its locks held.
+ */
+static
+void
+clean_thread(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
 
+	for (;;) {
+		P(clean_sem);
 
-#endif	
+		lock_acquire(core_map_lock);
+		clean_pending = false;
+
+		struct addrspace *as;
+		struct region *rg;
+		vaddr_t vaddr;
+		struct pagetable_entry *pte;
+
+		// Look again from the start after every page, address spaces
+		// may have come and gone while the lock was dropped
+		while ((pte = mapping_find_dirty(&as, &rg, &vaddr)) != NULL) {
+			if (mapping_clean_page(as, rg, pte, vaddr)) {
+				break; // leave the rest until eviction asks again
+			}
+		}
 
-	// spinlock_release(&stealmem_lock);
-	
-	return addr;
+		lock_release(core_map_lock);
+	}
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
+/*
+ * Pick the TLB slot to replace when they are all valid, according to
+ * tlb_policy. Returns -1 to let the hardware pick one at random.
+ * Interrupts must be off.
+ */
+static
+int
+tlb_victim(void)
 {
-	paddr_t pa;
-	pa = getppages(npages);
-	if (pa==0) {
-		return 0;
+	unsigned cpu = curcpu->c_number;
+	uint32_t ehi, elo;
+	unsigned i;
+
+	switch (tlb_policy) {
+	case TLB_POLICY_ROUNDROBIN:
+		i = tlb_hand[cpu];
+		tlb_hand[cpu] = (i + 1) % NUM_TLB;
+		return i;
+
+	case TLB_POLICY_CLOCK:
+		// Terminates within two sweeps, the first one clears every bit
+		for (;;) {
+			i = tlb_hand[cpu];
+			tlb_hand[cpu] = (i + 1) % NUM_TLB;
+
+			// Entries of other address spaces cannot be used until
+			// those run here again, they go first
+			tlb_read(&ehi, &elo, i);
+			if (!tlb_referenced[cpu][i] ||
+			    ((ehi & TLBHI_PID) >> TLBHI_PIDSHIFT) != tlb_asid[cpu]) {
+				return i;
+			}
+
+			tlb_referenced[cpu][i] = false; // second chance
+		}
+
+	default:
+		return -1;
 	}
-	return PADDR_TO_KVADDR(pa);
 }
 
-void 
-free_kpages(vaddr_t addr)
+/*
+ * Load a translation into this CPU's TLB, in a free slot if there is
+ * one, tagged with the ASID the CPU is currently using. COUNT says
+ * whether this is a TLB fault for the statistics.
+ */
+static
+void
+tlb_load(uint32_t ehi, uint32_t elo, bool count)
 {
-	/* nothing - leak the memory. */
+	uint32_t oldehi, oldelo;
 
-	// (void)addr;
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	int spl = splhigh();
 
-#if OPT_A3
+	// Read the ASID with interrupts off, a context switch may change it
+	ehi = (ehi & TLBHI_VPAGE) | (tlb_asid[curcpu->c_number] << TLBHI_PIDSHIFT);
 
-	if (core_map_lock == NULL) {
-		core_map_lock = lock_create("core_map_lock");
-		if (core_map_lock == NULL) {
-			kprintf("fail to create core_map_lock\n");
-			return;
+	for (int i = 0; i < NUM_TLB; i++) {
+		tlb_read(&oldehi, &oldelo, i);
+		if (oldelo & TLBLO_VALID) {
+			continue;
+		}
+		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", ehi, elo & TLBLO_PPAGE);
+		tlb_write(ehi, elo, i); // also restores the ASID tlb_read changed
+		tlb_referenced[curcpu->c_number][i] = true;
+		splx(spl);
+		if (count) {
+			vmstats_inc(VMSTAT_TLB_FAULT_FREE);
 		}
+		return;
 	}
 
-	lock_acquire(core_map_lock);
-
-	paddr_t paddr = addr - MIPS_KSEG0;
-	KASSERT(0 == ((paddr - BASE)%PAGE_SIZE)); // must be a valid paddr
-
-	unsigned long index = (paddr - BASE)/PAGE_SIZE; // get the corresponding entry
-
-	KASSERT(index < num_of_frames); // must be accessible in the core_map
-
-	long frames_need_to_free = (core_map+index)->num_frame;
-
-	KASSERT(frames_need_to_free > 0);
-
-	for (unsigned long i = index; i < index+frames_need_to_free; ++i) {
-		(core_map+i)->num_frame = 0;
+	// Run out of TLB (full) if the code goes here
+	int victim = tlb_victim();
+	if (victim < 0) {
+		tlb_random(ehi, elo);
+	} else {
+		tlb_write(ehi, elo, victim);
+		tlb_referenced[curcpu->c_number][victim] = true;
 	}
-
-	lock_release(core_map_lock);
+	splx(spl);
+	if (count) {
+		vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+	}
+}
 
 #endif
 
-}
-
 void
 vm_tlbshootdown_all(void)
 {
+#if OPT_A3
+	// tlb_shootdown never queues more than one request per CPU, so
+	// there is no ts_done to signal when we get here
+	tlb_flush();
+#else
 	panic("dumbvm tried to do tlb shootdown?!\n");
+#endif
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
+#if OPT_A3
+	tlb_invalidate(ts->ts_vaddr, ts->ts_addrspace->as_asid);
+	V(ts->ts_done);
+#else
 	(void)ts;
 	panic("dumbvm tried to do tlb shootdown?!\n");
+#endif
+}
+
+#if OPT_A3
+
+int
+vm_set_stack_limit(unsigned npages)
+{
+	// Leave room for at least the lowest 2MB of user space
+	if (npages < STACK_INITPAGES || npages > (USERSTACK - PT_L2_SPAN) / PAGE_SIZE) {
+		return EINVAL;
+	}
+
+	stack_limit = npages;
+	return 0;
 }
 
+int
+vm_set_tlb_policy(const char *name)
+{
+	for (int i = 0; i < TLB_POLICY_COUNT; ++i) {
+		if (0 == strcmp(name, tlb_policy_names[i])) {
+			tlb_policy = i;
+			return 0;
+		}
+	}
+
+	return EINVAL;
+}
+
+#endif
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
-	int i;
 	uint32_t ehi, elo;
 	struct addrspace *as;
+#if !OPT_A3
+	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+	int i;
 	int spl;
+#endif
 
 	faultaddress &= PAGE_FRAME;
 
@@ -314,10 +2132,9 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		/* We always create pages read-write, so we can't get this */
 		// panic("dumbvm: got VM_FAULT_READONLY\n");
 #if OPT_A3
-	    	/* EX_MOD means TLB Modify (write to read-only page) */
-	    	return EX_MOD;
-	    	// Instead of calling kill_curthread directly, return an error would trigger mips_trap
-	    	// kill_curthread((vaddr_t)NULL,EX_MOD,(vaddr_t)NULL);
+	    	// Either a write to a copy-on-write page or to the text segment,
+	    	// can only tell which after looking up the page table entry below
+	    	break;
 #endif
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
@@ -346,55 +2163,118 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 #if OPT_A3
 
-	/* Assert that the address space has been set up properly. */
-	KASSERT(as->as_vbase1 != 0);
-	KASSERT(as->as_pbase1 != NULL);
-	KASSERT(as->as_npages1 != 0);
-	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_pbase2 != NULL);
-	KASSERT(as->as_npages2 != 0);
-	KASSERT(as->as_stackpbase != NULL);
-	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	
-	for (size_t i = 0; i < as->as_npages1; ++i) {
-		KASSERT((((as->as_pbase1)+i)->addr_base & PAGE_FRAME) == ((as->as_pbase1)+i)->addr_base);
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
 	}
-	
 
-	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	
+	// Resident and swapped pages are found in constant time, the
+	// region list is only searched for pages that were never touched
+	struct pagetable_entry *pte = pagetable_lookup(as, faultaddress);
+	struct region *rg = NULL;
+
+	if (pte == NULL) {
+		rg = region_fault(as, faultaddress);
+		if (rg == NULL) {
+			return EFAULT;
+		}
 
-	for (size_t i = 0; i < as->as_npages2; ++i) {
-		KASSERT((((as->as_pbase2)+i)->addr_base & PAGE_FRAME) == ((as->as_pbase2)+i)->addr_base);
+		pte = pagetable_get(as, faultaddress);
+		if (pte == NULL) {
+			return ENOMEM;
+		}
 	}
 
-	for (size_t i = 0; i < DUMBVM_STACKPAGES; ++i) {
-		KASSERT((((as->as_stackpbase)+i)->addr_base & PAGE_FRAME) == ((as->as_stackpbase)+i)->addr_base);
+	lock_acquire(core_map_lock);
+
+	// Somebody is paging it in or out, wait until they are done
+	while (pte->busy) {
+		cv_wait(core_map_cv, core_map_lock);
 	}
 
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
+	if (pte->addr_base == 0 && !pte->swapped) { // never touched
+		if (rg == NULL) {
+			rg = region_fault(as, faultaddress);
+		}
+		if (rg == NULL) {
+			lock_release(core_map_lock);
+			return EFAULT;
+		}
+		pte->readonly = !rg->rg_writeable;
+		pte->mapped = (rg->rg_file != NULL && rg->rg_shared);
+	}
 
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		size_t page_number = (faultaddress - vbase1)/PAGE_SIZE;
-		paddr = ((as->as_pbase1)+page_number)->addr_base + (faultaddress - vbase1)%PAGE_SIZE;
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_FAULT);
 	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		size_t page_number = (faultaddress - vbase2)/PAGE_SIZE;
-		paddr = ((as->as_pbase2)+page_number)->addr_base + (faultaddress - vbase2)%PAGE_SIZE;
+
+	if (pte->addr_base == 0) { // first touch or evicted, page it in
+		int result = page_in(as, rg, pte, faultaddress);
+		if (result) {
+			lock_release(core_map_lock);
+			return result;
+		}
+	} else if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_RELOAD);
 	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		size_t page_number = (faultaddress - stackbase)/PAGE_SIZE;
-		paddr = ((as->as_stackpbase)+page_number)->addr_base + (faultaddress - stackbase)%PAGE_SIZE;
+
+	// Text is read-only once it has been loaded
+	bool readonly = pte->readonly && as->elf_loaded;
+
+	if (faulttype == VM_FAULT_READONLY) {
+		if (readonly) {
+			lock_release(core_map_lock);
+			/* EX_MOD means TLB Modify (write to read-only page) */
+			return EX_MOD;
+			// Instead of calling kill_curthread directly, return an error would trigger mips_trap
+		}
+
+		if (pte->cow) {
+			// Write to a page shared with parent/child, get a private copy first
+			int result = frame_break_cow(as, pte, faultaddress);
+			if (result) {
+				lock_release(core_map_lock);
+				return result;
+			}
+		}
+
+		// Drop the stale read-only translation, the writable one is loaded
+		// below. Other CPUs this process ran on may still have it too.
+		tlb_shootdown(as, faultaddress);
 	}
-	else {
-		return EFAULT;
+
+	frame_touch(as, pte, faultaddress);
+
+	paddr = pte->addr_base;
+
+	/* make sure it's page-aligned */
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	ehi = faultaddress;
+	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+
+	// Writes to text or to copy-on-write pages must trap. Shared
+	// mappings never are copy-on-write, every sharer writes the frame.
+	if (readonly || pte->cow) {
+		elo &= ~TLBLO_DIRTY;
+	}
+
+	// So must the first write to a clean page of a shared mapping, to
+	// find out it needs writing back
+	if (pte->mapped && (elo & TLBLO_DIRTY)) {
+		if (faulttype != VM_FAULT_READ) {
+			pte->dirty = true;
+		} else if (!pte->dirty) {
+			elo &= ~TLBLO_DIRTY;
+		}
 	}
 
+	// Still holding the lock, so the page cannot be evicted before it is in the TLB
+	tlb_load(ehi, elo, faulttype != VM_FAULT_READONLY);
+
+	lock_release(core_map_lock);
+
+	return 0;
+
 #else
 
 	/* Assert that the address space has been set up properly. */
@@ -431,8 +2311,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-#endif
-
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
@@ -446,36 +2324,18 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		}
 		ehi = faultaddress;
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-
-		#if OPT_A3
-
-		if (faultaddress >= vbase1 && faultaddress < vtop1 && as->elf_loaded) {
-			elo &= ~TLBLO_DIRTY;
-		}
-
-		#endif	
-			
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
 		splx(spl);
 		return 0;
 	}
 
-#if OPT_A3
-
-	// Run out of TLB (full) if the code goes here
-	ehi = faultaddress;
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	// Randomly replace an TLB entry	
-	tlb_random(ehi,elo);
-	splx(spl);
-	return 0;
-#endif
-
 	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
 	splx(spl);
 	return EFAULT;
 
+#endif
+
 }
 
 struct addrspace *
@@ -488,14 +2348,28 @@ as_create(void)
 
 #if OPT_A3
 
-	as->as_vbase1 = 0;
-	as->as_pbase1 = NULL;
-	as->as_npages1 = 0;
-	as->as_vbase2 = 0;
-	as->as_pbase2 = NULL;
-	as->as_npages2 = 0;
-	as->as_stackpbase = NULL;
+	as->as_regions = NULL;
+	as->as_stack = NULL;
+	as->as_heap = NULL;
+	as->as_heap_break = 0;
+	as->as_pagetable = kmalloc(sizeof(struct pagetable_entry *)*PT_L1_ENTRIES);
+	if (as->as_pagetable == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	for (size_t i = 0; i < PT_L1_ENTRIES; ++i) {
+		as->as_pagetable[i] = NULL;
+	}
 	as->elf_loaded = false;
+	as->as_vnode = NULL;
+	as->as_asid = 0;
+	as->as_asid_generation = 0; // never current, gets an ASID on activation
+	as->as_tlbcpus = 0;
+
+	lock_acquire(core_map_lock);
+	as->as_next = all_addrspaces;
+	all_addrspaces = as;
+	lock_release(core_map_lock);
 
 #else
 
@@ -518,21 +2392,45 @@ as_destroy(struct addrspace *as)
 
 #if OPT_A3
 
-	for (size_t i = 0; i < as->as_npages1; ++i) {
-		free_kpages(PADDR_TO_KVADDR(((as->as_pbase1)+i)->addr_base));
+	// Changes to shared mappings must reach their files before the
+	// frames go away. There is nobody left to report errors to.
+	for (struct region *rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_file != NULL && rg->rg_shared) {
+			as_msync(as, rg->rg_vbase, rg->rg_npages * PAGE_SIZE);
+		}
+	}
+
+	lock_acquire(core_map_lock);
+	// Eviction must not look at the tables once they are freed
+	struct addrspace **link = &all_addrspaces;
+	while (*link != as) {
+		KASSERT(*link != NULL);
+		link = &(*link)->as_next;
+	}
+	*link = as->as_next;
+
+	for (size_t i = 0; i < PT_L1_ENTRIES; ++i) {
+		pagetable_release(as->as_pagetable[i], PT_L2_ENTRIES);
 	}
+	lock_release(core_map_lock);
 
-	for (size_t i = 0; i < as->as_npages2; ++i) {
-		free_kpages(PADDR_TO_KVADDR(((as->as_pbase2)+i)->addr_base));
+	for (size_t i = 0; i < PT_L1_ENTRIES; ++i) {
+		kfree(as->as_pagetable[i]);
 	}
+	kfree(as->as_pagetable);
 
-	for (size_t i = 0; i < DUMBVM_STACKPAGES; ++i) {
-		free_kpages(PADDR_TO_KVADDR(((as->as_stackpbase)+i)->addr_base));
+	while (as->as_regions != NULL) {
+		struct region *rg = as->as_regions;
+		as->as_regions = rg->rg_next;
+		if (rg->rg_file != NULL) {
+			VOP_DECREF(rg->rg_file);
+		}
+		kfree(rg);
 	}
 
-	kfree(as->as_pbase1);
-	kfree(as->as_pbase2);
-	kfree(as->as_stackpbase);
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
+	}
 
 #endif
 
@@ -553,6 +2451,18 @@ as_activate(void)
 		return;
 	}
 
+#if OPT_A3
+
+	(void)i;
+
+	// No flush needed, translations of other address spaces carry
+	// other ASIDs and so do not match
+	spl = splhigh();
+	asid_activate(as, false);
+	splx(spl);
+
+#else
+
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
@@ -561,6 +2471,8 @@ as_activate(void)
 	}
 
 	splx(spl);
+
+#endif
 }
 
 void
@@ -584,6 +2496,43 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	npages = sz / PAGE_SIZE;
 
+#if OPT_A3
+	// Nothing copies the segment through uiomove any more, so
+	// check here that it does not reach into kernel space
+	if (vaddr + sz < vaddr || vaddr + sz > USERSPACETOP) {
+		return EFAULT;
+	}
+
+	(void)readable;
+	(void)executable;
+
+	struct region *rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = npages;
+	rg->rg_writeable = writeable;
+	rg->rg_source.vaddr = vaddr;
+	rg->rg_source.offset = 0;
+	rg->rg_source.filesize = 0;
+	rg->rg_file = NULL;
+	rg->rg_shared = false;
+
+	// Keep the list in the order the regions were defined, where they
+	// overlap the first one wins
+	struct region **tail = &as->as_regions;
+	while (*tail != NULL) {
+		tail = &(*tail)->rg_next;
+	}
+	rg->rg_next = NULL;
+	*tail = rg;
+
+	return 0;
+
+#else
+
 	/* We don't use these - all pages are read-write */
 	(void)readable;
 	(void)writeable;
@@ -592,18 +2541,12 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	if (as->as_vbase1 == 0) {
 		as->as_vbase1 = vaddr;
 		as->as_npages1 = npages;
-#if OPT_A3		
-		as->as_pbase1 = kmalloc(sizeof(struct pagetable_entry)*npages);
-#endif		
 		return 0;
 	}
 
 	if (as->as_vbase2 == 0) {
 		as->as_vbase2 = vaddr;
 		as->as_npages2 = npages;
-#if OPT_A3		
-		as->as_pbase2 = kmalloc(sizeof(struct pagetable_entry)*npages);
-#endif		
 		return 0;
 	}
 
@@ -612,8 +2555,12 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	 */
 	kprintf("dumbvm: Warning: too many regions\n");
 	return EUNIMP;
+
+#endif
 }
 
+#if !OPT_A3
+
 static
 void
 as_zero_region(paddr_t paddr, unsigned npages)
@@ -621,44 +2568,26 @@ as_zero_region(paddr_t paddr, unsigned npages)
 	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
 }
 
+#endif
+
 int
 as_prepare_load(struct addrspace *as)
 {
 
 #if OPT_A3
 
-	KASSERT(as->as_pbase1 != NULL);
-	KASSERT(as->as_pbase2 != NULL);
-	KASSERT(as->as_stackpbase == NULL);
-
-	for (size_t i = 0; i < as->as_npages1; ++i) {
-		((as->as_pbase1)+i)->addr_base = getppages(1);
-		if (((as->as_pbase1)+i)->addr_base == 0) {
-			return ENOMEM;
-		}
-		as_zero_region((as->as_pbase1)->addr_base, 1);
-	}
-
-	for (size_t i = 0; i < as->as_npages2; ++i) {
-		((as->as_pbase2)+i)->addr_base = getppages(1);
-		if (((as->as_pbase2)+i)->addr_base == 0) {
-			return ENOMEM;
-		}
-		as_zero_region((as->as_pbase2)->addr_base, 1);
-	}
-
-	// Create a page table for stack
-	as->as_stackpbase = kmalloc(sizeof(struct pagetable_entry)*DUMBVM_STACKPAGES);
-
-	for (size_t i = 0; i < DUMBVM_STACKPAGES; ++i) {
-		((as->as_stackpbase)+i)->addr_base = getppages(1);
-		if (((as->as_stackpbase)+i)->addr_base == 0) {
-			return ENOMEM;
-		}
-		as_zero_region((as->as_stackpbase)->addr_base, 1);
+	// All frames, including the stack's, are allocated and zeroed
+	// by vm_fault on first touch; the stack only needs a region
+	int result = as_define_region(as, USERSTACK - STACK_INITPAGES * PAGE_SIZE,
+				      STACK_INITPAGES * PAGE_SIZE, 1, 1, 0);
+	if (result) {
+		return result;
 	}
 
+	as->as_stack = region_find_base(as, USERSTACK - STACK_INITPAGES * PAGE_SIZE);
+	KASSERT(as->as_stack != NULL);
 
+	return 0;
 
 #else
 
@@ -697,6 +2626,21 @@ as_complete_load(struct addrspace *as)
 
 	// Load elf finished, set the flag true
 	as->elf_loaded = true;
+
+	// The heap starts out empty, just past the highest segment
+	vaddr_t heapbase = 0;
+	for (struct region *rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg != as->as_stack && rg->rg_vbase + rg->rg_npages * PAGE_SIZE > heapbase) {
+			heapbase = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		}
+	}
+
+	int result = as_define_region(as, heapbase, 0, 1, 1, 0);
+	if (result) {
+		return result;
+	}
+	as->as_heap = region_find_base(as, heapbase);
+	as->as_heap_break = heapbase;
 /*
 	uint32_t ehi, elo;
 	// Flush the TLB with (distinct) invalid TLBHI and invalid TLBLO
@@ -706,8 +2650,13 @@ as_complete_load(struct addrspace *as)
 		tlb_write(ehi,elo,i);
 	}
 */
-	// as_activate will flush the TLB
-	as_activate();
+	// Text is read-only from now on, drop any writable translations
+	// loaded while it was being set up by giving AS a fresh ASID
+	if (as == curproc_getas()) {
+		int spl = splhigh();
+		asid_activate(as, true);
+		splx(spl);
+	}
 
 #endif	
 	return 0;
@@ -716,7 +2665,11 @@ as_complete_load(struct addrspace *as)
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr, char **args, unsigned long nargs)
 {
+#if OPT_A3
+	KASSERT(as->as_stack != NULL);
+#else
 	KASSERT(as->as_stackpbase != 0);
+#endif
 
 #if OPT_A2
 
@@ -782,50 +2735,79 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
-	new->as_vbase1 = old->as_vbase1;
-	new->as_npages1 = old->as_npages1;
-	new->as_vbase2 = old->as_vbase2;
-	new->as_npages2 = old->as_npages2;
-
 #if OPT_A3
 
-	new->as_pbase1 = kmalloc(sizeof(struct pagetable_entry)*new->as_npages1);
-	new->as_pbase2 = kmalloc(sizeof(struct pagetable_entry)*new->as_npages2);
-
-#endif	
-
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new)) {
-		as_destroy(new);
-		return ENOMEM;
+	new->elf_loaded = old->elf_loaded;
+	new->as_heap_break = old->as_heap_break;
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
 	}
 
-#if OPT_A3
-
-	KASSERT(new->as_pbase1 != NULL);
-	KASSERT(new->as_pbase2 != NULL);
-	KASSERT(new->as_stackpbase != NULL);
-
-	for (size_t i = 0; i < new->as_npages1; ++i) {
-		memmove((void *)PADDR_TO_KVADDR(((new->as_pbase1)+i)->addr_base),
-			(const void *)PADDR_TO_KVADDR(((old->as_pbase1)+i)->addr_base),
-			PAGE_SIZE);
+	struct region **tail = &new->as_regions;
+	for (struct region *rg = old->as_regions; rg != NULL; rg = rg->rg_next) {
+		struct region *copy = kmalloc(sizeof(struct region));
+		if (copy == NULL) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		*copy = *rg;
+		copy->rg_next = NULL;
+		if (rg->rg_file != NULL) {
+			VOP_INCREF(rg->rg_file);
+		}
+		if (rg == old->as_stack) {
+			new->as_stack = copy;
+		}
+		if (rg == old->as_heap) {
+			new->as_heap = copy;
+		}
+		// clean_thread may already be looking at the list
+		*tail = copy;
+		tail = &copy->rg_next;
 	}
 
-	for (size_t i = 0; i < new->as_npages2; ++i) {
-		memmove((void *)PADDR_TO_KVADDR(((new->as_pbase2)+i)->addr_base),
-			(const void *)PADDR_TO_KVADDR(((old->as_pbase2)+i)->addr_base),
-			PAGE_SIZE);
+	// Share every frame copy-on-write instead of copying it now,
+	// the child usually calls execv before touching most of them.
+	// Frames of shared mappings are just shared.
+	// All tables are allocated first, kmalloc cannot be called with
+	// core_map_lock held.
+	for (size_t i = 0; i < PT_L1_ENTRIES; ++i) {
+		if (old->as_pagetable[i] != NULL) {
+			new->as_pagetable[i] = pagetable_create();
+			if (new->as_pagetable[i] == NULL) {
+				as_destroy(new);
+				return ENOMEM;
+			}
+		}
 	}
 
-	for (size_t i = 0; i < DUMBVM_STACKPAGES; ++i) {
-		memmove((void *)PADDR_TO_KVADDR(((new->as_stackpbase)+i)->addr_base),
-			(const void *)PADDR_TO_KVADDR(((old->as_stackpbase)+i)->addr_base),
-			PAGE_SIZE);
+	lock_acquire(core_map_lock);
+	for (size_t i = 0; i < PT_L1_ENTRIES; ++i) {
+		if (old->as_pagetable[i] != NULL) {
+			pagetable_share(new->as_pagetable[i], old->as_pagetable[i], PT_L2_ENTRIES);
+		}
 	}
+	lock_release(core_map_lock);
+
+	// The parent may still have writable translations for the shared
+	// frames, on this CPU or others it ran on. Retiring its ASID makes
+	// all of them unreachable at once.
+	asid_retire(old);
 
 #else
 
+	new->as_vbase1 = old->as_vbase1;
+	new->as_npages1 = old->as_npages1;
+	new->as_vbase2 = old->as_vbase2;
+	new->as_npages2 = old->as_npages2;
+
+	/* (Mis)use as_prepare_load to allocate some physical memory. */
+	if (as_prepare_load(new)) {
+		as_destroy(new);
+		return ENOMEM;
+	}
+
 	KASSERT(new->as_pbase1 != 0);
 	KASSERT(new->as_pbase2 != 0);
 	KASSERT(new->as_stackpbase != 0);
@@ -847,3 +2829,288 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	*ret = new;
 	return 0;
 }
+
+#if OPT_A3
+
+int
+as_define_source(struct addrspace *as, struct vnode *v,
+		 off_t offset, vaddr_t vaddr, size_t filesize)
+{
+	struct region *rg = region_find(as, vaddr);
+	if (rg == NULL) {
+		return EFAULT;
+	}
+
+	struct segment_source *src = &rg->rg_source;
+	src->vaddr = vaddr;
+	src->offset = offset;
+	src->filesize = filesize;
+
+	// Keep the executable open for as long as pages may be read from it
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	KASSERT(as->as_vnode == v);
+
+	return 0;
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct region *heap = as->as_heap;
+
+	if (heap == NULL) {
+		return ENOMEM;
+	}
+
+	vaddr_t old = as->as_heap_break;
+	vaddr_t new = old + amount;
+
+	if (amount < 0 && (new > old || new < heap->rg_vbase)) {
+		return EINVAL;
+	}
+	if (amount > 0 && new < old) {
+		return ENOMEM;
+	}
+
+	// Leave room for the stack to grow to its limit
+	vaddr_t top = USERSTACK - stack_limit * PAGE_SIZE;
+	if (as->as_stack != NULL && as->as_stack->rg_vbase < top) {
+		top = as->as_stack->rg_vbase;
+	}
+	// and below the mappings, which are placed under the stack
+	for (struct region *rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_file != NULL && rg->rg_vbase < top) {
+			top = rg->rg_vbase;
+		}
+	}
+	if (new > top) {
+		return ENOMEM;
+	}
+
+	size_t npages = (ROUNDUP(new, PAGE_SIZE) - heap->rg_vbase) / PAGE_SIZE;
+
+	if (npages < heap->rg_npages) {
+		// Give the frames and swap slots of the dropped pages back
+		lock_acquire(core_map_lock);
+
+		for (size_t i = npages; i < heap->rg_npages; ++i) {
+			struct pagetable_entry *pte = pagetable_lookup(as, heap->rg_vbase + i * PAGE_SIZE);
+			if (pte != NULL) {
+				pagetable_release(pte, 1);
+				pte->readonly = false;
+			}
+		}
+
+		// Before anybody can reuse the frames, make sure the old
+		// translations can no longer be used
+		asid_retire(as);
+
+		lock_release(core_map_lock);
+	}
+
+	// New pages are zero-filled by vm_fault on first touch
+	heap->rg_npages = npages;
+	as->as_heap_break = new;
+
+	*oldbreak = old;
+	return 0;
+}
+
+/*
+ * Write the page at VADDR of shared mapping RG back to its file, if it
+ * has been changed since it was last written back.
+ */
+static
+int
+mapping_sync_page(struct addrspace *as, struct region *rg, vaddr_t vaddr)
+{
+	lock_acquire(core_map_lock);
+
+	struct pagetable_entry *pte = pagetable_lookup(as, vaddr);
+	if (pte == NULL) {
+		lock_release(core_map_lock);
+		return 0;
+	}
+
+	while (pte->busy) {
+		cv_wait(core_map_cv, core_map_lock);
+	}
+
+	int result = 0;
+	if (pte->addr_base != 0 && pte->dirty) {
+		result = mapping_clean_page(as, rg, pte, vaddr);
+	}
+
+	lock_release(core_map_lock);
+
+	return result;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *v, off_t offset, size_t len,
+	bool writeable, bool shared, vaddr_t *ret)
+{
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+
+	int result = VOP_MMAP(v, offset, len);
+	if (result) {
+		return result;
+	}
+
+	size_t npages = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+	size_t size = npages * PAGE_SIZE;
+
+	// Mappings go top-down from below the furthest the stack may grow,
+	// the heap grows up towards them
+	vaddr_t top = USERSTACK - stack_limit * PAGE_SIZE;
+	if (as->as_stack != NULL && as->as_stack->rg_vbase < top) {
+		top = as->as_stack->rg_vbase;
+	}
+
+	vaddr_t floor = ROUNDUP(as->as_heap_break, PAGE_SIZE);
+	vaddr_t vaddr = top - size;
+	bool moved = true;
+
+	while (moved) {
+		if (top < size || vaddr < floor) {
+			return ENOMEM;
+		}
+		moved = false;
+		for (struct region *rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+			vaddr_t rgtop = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+			if (rg != as->as_stack && rg->rg_vbase < vaddr + size && rgtop > vaddr) {
+				top = rg->rg_vbase;
+				vaddr = top - size;
+				moved = true;
+				break;
+			}
+		}
+	}
+
+	struct region *rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = npages;
+	rg->rg_writeable = writeable;
+	rg->rg_source.vaddr = vaddr;
+	rg->rg_source.offset = offset;
+	rg->rg_source.filesize = len;
+	rg->rg_file = v;
+	rg->rg_shared = shared;
+
+	VOP_INCREF(v);
+
+	rg->rg_next = as->as_regions;
+	as->as_regions = rg;
+
+	*ret = vaddr;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *rg = NULL;
+	struct region **link;
+
+	for (link = &as->as_regions; *link != NULL; link = &(*link)->rg_next) {
+		if ((*link)->rg_file != NULL && (*link)->rg_vbase == vaddr) {
+			rg = *link;
+			break;
+		}
+	}
+
+	// Only whole mappings can be removed
+	if (rg == NULL || ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE != rg->rg_npages) {
+		return EINVAL;
+	}
+
+	if (rg->rg_shared) {
+		int result = as_msync(as, vaddr, len);
+		if (result) {
+			return result;
+		}
+	}
+
+	lock_acquire(core_map_lock);
+
+	for (size_t i = 0; i < rg->rg_npages; ++i) {
+		struct pagetable_entry *pte = pagetable_lookup(as, vaddr + i * PAGE_SIZE);
+		if (pte != NULL) {
+			pagetable_release(pte, 1);
+			pte->readonly = false;
+			pte->mapped = false;
+			pte->dirty = false;
+		}
+	}
+
+	*link = rg->rg_next;
+
+	// Before anybody can reuse the frames, make sure the old
+	// translations can no longer be used
+	asid_retire(as);
+
+	lock_release(core_map_lock);
+
+	VOP_DECREF(rg->rg_file);
+	kfree(rg);
+
+	return 0;
+}
+
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	if (vaddr % PAGE_SIZE != 0 || vaddr + len < vaddr) {
+		return EINVAL;
+	}
+
+	vaddr_t end = vaddr + len;
+	bool mapped = (len == 0);
+
+	for (struct region *rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		vaddr_t lo = rg->rg_vbase;
+		vaddr_t hi = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (lo < vaddr) {
+			lo = vaddr;
+		}
+		if (hi > end) {
+			hi = end;
+		}
+		if (lo >= hi) {
+			continue;
+		}
+		mapped = true;
+
+		if (rg->rg_file == NULL || !rg->rg_shared) {
+			continue;
+		}
+
+		for (vaddr_t va = lo; va < hi; va += PAGE_SIZE) {
+			int result = mapping_sync_page(as, rg, va);
+			if (result) {
+				return result;
+			}
+		}
+	}
+
+	// Nothing at all there
+	if (!mapped) {
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+#endif
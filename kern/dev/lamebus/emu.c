@@ -479,11 +479,17 @@ emufs_reclaim(struct vnode *v)
 	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
+	/* Someone may have picked it up again since VOP_DECREF */
+	spinlock_acquire(&ev->ev_v.vn_countlock);
 	if (ev->ev_v.vn_refcount != 1) {
+		KASSERT(ev->ev_v.vn_refcount > 1);
+		ev->ev_v.vn_refcount--;
+		spinlock_release(&ev->ev_v.vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	spinlock_release(&ev->ev_v.vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
@@ -840,10 +846,16 @@ emufs_namefile(struct vnode *v, struct uio *uio)
  */
 static
 int
-emufs_mmap(struct vnode *v)
+emufs_mmap(struct vnode *v, off_t offset, size_t len)
 {
 	(void)v;
-	return EUNIMP;
+	(void)len;
+
+	if (offset < 0) {
+		return EINVAL;
+	}
+
+	return 0;
 }
 
 //////////////////////////////
@@ -1059,6 +1071,16 @@ emufs_lookparent_notdir(struct vnode *v, char *pathname, struct vnode **result,
 }
 
 
+static
+int
+emufs_mmap_isdir(struct vnode *v, off_t offset, size_t len)
+{
+	(void)v;
+	(void)offset;
+	(void)len;
+	return EISDIR;
+}
+
 static
 int
 emufs_truncate_isdir(struct vnode *v, off_t len)
@@ -1124,7 +1146,7 @@ static const struct vnode_ops emufs_dirops = {
 	emufs_dir_gettype,
 	emufs_dir_tryseek,
 	emufs_void_op_isdir,  /* fsync */
-	emufs_void_op_isdir,  /* mmap */
+	emufs_mmap_isdir,
 	emufs_truncate_isdir,
 	emufs_namefile,
 
@@ -29,13 +29,25 @@
 
 /*
  * LAMEbus hard disk (lhd) driver.
+ *
+ * Requests are queued per disk and served in C-LOOK order: the head
+ * sweeps towards higher sectors, then jumps back to the lowest waiting
+ * request. So that nothing starves, a request that has waited longer
+ * than LHD_MAXWAIT_REVS disk revolutions is served next regardless.
+ * The disk is driven from the interrupt handler, which moves on to the
+ * next sector or request by itself; callers only wait for their own
+ * request to finish.
  */
 
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <clock.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -59,6 +71,9 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Revolutions a request may wait before it goes ahead of the sweep */
+#define LHD_MAXWAIT_REVS 64
+
 /*
  * Shortcut for reading a register.
  */
@@ -95,15 +110,157 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Current time in nanoseconds.
+ */
+static
+uint64_t
+lhd_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+static void lhd_start(struct lhd_softc *lh);
+
+/*
+ * Record that the active request has finished, wake up whoever waits
+ * for it, and get the disk going on the next one.
+ */
+static
+void
+lhd_finish(struct lhd_softc *lh, int err)
+{
+	struct lhd_request *lr = lh->lh_active;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_qlock));
+	KASSERT(lr != NULL);
+
+	lr->lr_result = err;
+	lr->lr_done = true;
+	lh->lh_active = NULL;
+	wchan_wakeall(lh->lh_wchan);
+
+	lhd_start(lh);
+}
+
+/*
+ * Start the operation on sector lh_cursect of the active request.
+ */
+static
+void
+lhd_issue(struct lhd_softc *lh)
+{
+	struct lhd_request *lr = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_qlock));
+
+	/*
+	 * Are we writing? If so, transfer the data to the
+	 * on-card buffer.
+	 */
+	if (lr->lr_uio->uio_rw == UIO_WRITE) {
+		result = uiomove(lh->lh_buf, LHD_SECTSIZE, lr->lr_uio);
+		if (result) {
+			lhd_finish(lh, result);
+			return;
+		}
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, lh->lh_cursect);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the disk is idle, pick the next request and start it.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	struct lhd_request **link, **pick, **oldest;
+	struct lhd_request *lr;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_qlock));
+
+	if (lh->lh_active != NULL || lh->lh_queue == NULL) {
+		return;
+	}
+
+	/*
+	 * The queue is sorted by sector, so the first request at or
+	 * past the head is next on the sweep; if there is none, wrap
+	 * around to the first one.
+	 */
+	pick = NULL;
+	oldest = &lh->lh_queue;
+	for (link = &lh->lh_queue; *link != NULL; link = &(*link)->lr_next) {
+		if (pick == NULL && (*link)->lr_sector >= lh->lh_headsect) {
+			pick = link;
+		}
+		if ((*link)->lr_stamp < (*oldest)->lr_stamp) {
+			oldest = link;
+		}
+	}
+	if (pick == NULL) {
+		pick = &lh->lh_queue;
+	}
+	if (lh->lh_maxwait > 0 &&
+	    lhd_now() - (*oldest)->lr_stamp > lh->lh_maxwait) {
+		pick = oldest;
+	}
+
+	lr = *pick;
+	*pick = lr->lr_next;
+	lr->lr_next = NULL;
+
+	lh->lh_active = lr;
+	lh->lh_cursect = lr->lr_sector;
+	lhd_issue(lh);
+}
+
+/*
+ * A sector has been transferred: move its data out if reading, and go
+ * on with the rest of the request or the next request.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_request *lr;
+
+	spinlock_acquire(&lh->lh_qlock);
+
+	lr = lh->lh_active;
+	KASSERT(lr != NULL);
+
+	lh->lh_headsect = lh->lh_cursect;
+
+	/*
+	 * Are we reading? If so, and if we succeeded,
+	 * transfer the data out of the on-card buffer.
+	 */
+	if (err == 0 && lr->lr_uio->uio_rw == UIO_READ) {
+		err = uiomove(lh->lh_buf, LHD_SECTSIZE, lr->lr_uio);
+	}
+
+	if (err == 0 && lh->lh_cursect + 1 < lr->lr_sector + lr->lr_nsect) {
+		lh->lh_cursect++;
+		lhd_issue(lh);
+	}
+	else {
+		lhd_finish(lh, err);
+	}
+
+	spinlock_release(&lh->lh_qlock);
 }
 
 /*
@@ -132,6 +289,80 @@ lhd_irq(void *vlh)
 	}
 }
 
+/*
+ * Queue a request to transfer the sectors UIO describes. UIO must be
+ * in kernel space, because the transfer happens in interrupt context.
+ */
+int
+lhd_submit(struct lhd_softc *lh, struct lhd_request *lr, struct uio *uio)
+{
+	struct lhd_request **link;
+
+	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
+	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
+	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
+	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
+
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE);
+
+	/* Don't allow I/O that isn't sector-aligned. */
+	if (sectoff != 0 || lenoff != 0) {
+		return EINVAL;
+	}
+
+	/* Don't allow I/O past the end of the disk. */
+	if (sector+len > lh->lh_dev.d_blocks) {
+		return EINVAL;
+	}
+
+	lr->lr_uio = uio;
+	lr->lr_sector = sector;
+	lr->lr_nsect = len;
+	lr->lr_stamp = lhd_now();
+	lr->lr_result = 0;
+	lr->lr_done = false;
+	lr->lr_next = NULL;
+
+	if (len == 0) {
+		lr->lr_done = true;
+		return 0;
+	}
+
+	spinlock_acquire(&lh->lh_qlock);
+	for (link = &lh->lh_queue; *link != NULL; link = &(*link)->lr_next) {
+		if ((*link)->lr_sector > sector) {
+			break;
+		}
+	}
+	lr->lr_next = *link;
+	*link = lr;
+	lhd_start(lh);
+	spinlock_release(&lh->lh_qlock);
+
+	return 0;
+}
+
+/*
+ * Wait for a submitted request to finish, and return its result.
+ */
+int
+lhd_wait(struct lhd_softc *lh, struct lhd_request *lr)
+{
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&lh->lh_qlock);
+	while (!lr->lr_done) {
+		/* Bridge to the wchan lock, as in P() */
+		wchan_lock(lh->lh_wchan);
+		spinlock_release(&lh->lh_qlock);
+		wchan_sleep(lh->lh_wchan);
+		spinlock_acquire(&lh->lh_qlock);
+	}
+	spinlock_release(&lh->lh_qlock);
+
+	return lr->lr_result;
+}
+
 /*
  * Function called when we are open()'d.
  */
@@ -201,75 +432,51 @@ int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
-
-	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
-	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
-	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
-	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	struct lhd_request lr;
+	char buf[LHD_SECTSIZE];
+	struct iovec iov;
+	struct uio ku;
 	int result;
 
-	/* Don't allow I/O that isn't sector-aligned. */
-	if (sectoff != 0 || lenoff != 0) {
-		return EINVAL;
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		result = lhd_submit(lh, &lr, uio);
+		if (result) {
+			return result;
+		}
+		return lhd_wait(lh, &lr);
 	}
 
-	/* Don't allow I/O past the end of the disk. */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	/*
+	 * User memory can only be touched from the caller's thread, so
+	 * go through a kernel buffer a sector at a time.
+	 */
+	if (uio->uio_offset % LHD_SECTSIZE != 0 ||
+	    uio->uio_resid % LHD_SECTSIZE != 0) {
 		return EINVAL;
 	}
-
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
-	}
-
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
+	while (uio->uio_resid > 0) {
+		uio_kinit(&iov, &ku, buf, LHD_SECTSIZE, uio->uio_offset,
+			  uio->uio_rw);
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+			result = uiomove(buf, LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
 				return result;
 			}
 		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		result = lhd_submit(lh, &lr, &ku);
+		if (result) {
+			return result;
 		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		result = lhd_wait(lh, &lr);
 		if (result) {
 			return result;
 		}
+		if (uio->uio_rw == UIO_READ) {
+			result = uiomove(buf, LHD_SECTSIZE, uio);
+			if (result) {
+				return result;
+			}
+		}
 	}
 
 	return 0;
@@ -282,6 +489,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	uint32_t rpm;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -289,16 +497,25 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_qlock);
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_qlock);
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_cursect = 0;
+	lh->lh_headsect = 0;
+
+	/* A revolution takes 60 seconds over the speed in RPM. */
+	rpm = bus_read_register(lh->lh_busdata, lh->lh_buspos, LHD_REG_RPM);
+	if (rpm > 0) {
+		lh->lh_maxwait = LHD_MAXWAIT_REVS * (60000000000ULL / rpm);
+	}
+	else {
+		lh->lh_maxwait = 0;
 	}
 
 	/* Set up the VFS device structure. */
@@ -31,12 +31,28 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <spinlock.h>
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * A request for a run of sectors. The data moves through a kernel-space
+ * uio, which may have several iovecs. Callers own the structure and
+ * must leave it alone between lhd_submit and lhd_wait.
+ */
+struct lhd_request {
+	struct uio *lr_uio;		/* Data, and whether to read or write */
+	uint32_t lr_sector;		/* First sector */
+	uint32_t lr_nsect;		/* Number of sectors */
+	uint64_t lr_stamp;		/* When it was submitted (ns) */
+	int lr_result;			/* Result, once done */
+	bool lr_done;			/* True when finished */
+	struct lhd_request *lr_next;	/* Queue, in sector order */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +67,13 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_qlock;	/* Protects the fields below */
+	struct wchan *lh_wchan;		/* Where lhd_wait sleeps */
+	struct lhd_request *lh_queue;	/* Waiting requests, by sector */
+	struct lhd_request *lh_active;	/* Request the disk is working on */
+	uint32_t lh_cursect;		/* Sector being transferred */
+	uint32_t lh_headsect;		/* Last sector transferred */
+	uint64_t lh_maxwait;		/* ns before a request jumps the queue */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -61,4 +81,8 @@ struct lhd_softc {
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+/* Asynchronous interface: queue a request, then wait for it to finish */
+int lhd_submit(struct lhd_softc *lh, struct lhd_request *lr, struct uio *uio);
+int lhd_wait(struct lhd_softc *lh, struct lhd_request *lr);
+
 #endif /* _LAMEBUS_LHD_H_ */
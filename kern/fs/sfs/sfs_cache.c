@@ -0,0 +1,1078 @@
+/*
+ * SFS filesystem
+ *
+ * Buffer cache: a fixed set of block-sized buffers shared by every
+ * mounted SFS, looked up by (filesystem, block) through a hash table.
+ * Unreferenced buffers are reused least recently used first. Writes
+ * only dirty the buffer; dirty buffers reach the disk when they are
+ * reused or when the filesystem is synced.
+ *
+ * Blocks can also be queued for reading ahead; a kernel thread reads
+ * them into the cache in the background.
+ *
+ * Runs of consecutive blocks, when syncing or reading ahead, go to the
+ * device as one request of up to SFS_CLUSTER blocks.
+ *
+ * Dirty buffers are also written behind by a syncer thread: those
+ * that have been dirty for SFS_WBAGE seconds, or all of them when
+ * more than SFS_WBHIGH are dirty. Every SFS_SYNCINTERVAL seconds it
+ * also syncs the filesystems, which pushes dirty inodes and freemaps
+ * into the cache.
+ *
+ * A buffer dirtied on behalf of a file is put on the file's list of
+ * dirty buffers until it is written, so that fsync can write just
+ * those.
+ *
+ * sfs_buflock protects the cache itself: the hash table, the LRU list,
+ * and each buffer's identity, counts and flags. It is not held during
+ * disk I/O; a buffer being read or written is marked busy instead, and
+ * whoever needs it waits on sfs_bufcv. The contents of a buffer are
+ * protected by whatever protects the block: the vnode lock for inodes,
+ * indirect, data and directory blocks, and the freemap lock for the
+ * freemap and the superblock.
+ *
+ * Those locks are not taken when a buffer is written out, so buffers
+ * are only changed while the changer holds a reference, and are only
+ * written out while nobody holds one. The disk never sees a change
+ * half made.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <clock.h>
+#include <vfs.h>
+#include <sfs.h>
+
+/* Number of buffers, and of hash chains */
+#define SFS_NBUF     128
+#define SFS_NBUFHASH 61
+
+static struct sfs_buf sfs_bufs[SFS_NBUF];
+static struct sfs_buf *sfs_bufhash[SFS_NBUFHASH];
+
+/* Every buffer, least recently used first */
+static struct sfs_buf *sfs_lruhead;
+static struct sfs_buf *sfs_lrutail;
+
+static struct lock *sfs_buflock;
+static struct cv *sfs_bufcv;
+static bool sfs_bufs_ready = false;
+
+/*
+ * Blocks waiting to be read ahead, oldest first. Requests that do not
+ * fit are dropped. sfs_prefetch_sem counts the requests queued.
+ */
+#define SFS_NPREFETCH 32
+
+static struct {
+	struct sfs_fs *pf_fs;
+	uint32_t pf_block;
+} sfs_prefetchq[SFS_NPREFETCH];
+static unsigned sfs_prefetch_head, sfs_prefetch_count;
+static struct semaphore *sfs_prefetch_sem;
+
+static void sfs_prefetch_thread(void *data1, unsigned long data2);
+
+/* Write-behind policy */
+#define SFS_SYNCTICKS     10	/* timer ticks between syncer passes */
+#define SFS_WBAGE         3	/* seconds a buffer may stay dirty */
+#define SFS_WBHIGH        (SFS_NBUF/2)	/* dirty buffers that trigger a flush */
+#define SFS_SYNCINTERVAL  30	/* seconds between filesystem syncs */
+
+static void sfs_syncer_thread(void *data1, unsigned long data2);
+
+/* Statistics */
+static unsigned sfs_bufhits;        /* lookups that found the block */
+static unsigned sfs_bufmisses;      /* blocks read from disk */
+static unsigned sfs_bufwrites;      /* blocks written to disk */
+static unsigned sfs_bufprefetches;  /* blocks read ahead */
+static unsigned sfs_bufwritebehind; /* blocks written by the syncer */
+
+static
+void
+sfs_lru_remove(struct sfs_buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		sfs_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		sfs_lrutail = b->b_lruprev;
+	}
+	b->b_lrunext = b->b_lruprev = NULL;
+}
+
+/* Put B at the most recently used end */
+static
+void
+sfs_lru_append(struct sfs_buf *b)
+{
+	b->b_lruprev = sfs_lrutail;
+	b->b_lrunext = NULL;
+	if (sfs_lrutail != NULL) {
+		sfs_lrutail->b_lrunext = b;
+	}
+	else {
+		sfs_lruhead = b;
+	}
+	sfs_lrutail = b;
+}
+
+/* Put B at the least recently used end, to be reused first */
+static
+void
+sfs_lru_prepend(struct sfs_buf *b)
+{
+	b->b_lrunext = sfs_lruhead;
+	b->b_lruprev = NULL;
+	if (sfs_lruhead != NULL) {
+		sfs_lruhead->b_lruprev = b;
+	}
+	else {
+		sfs_lrutail = b;
+	}
+	sfs_lruhead = b;
+}
+
+/*
+ * Set up the cache and start its threads. Called on every
+ * mount; mounts are serialized by the VFS big lock.
+ */
+int
+sfs_binit(void)
+{
+	unsigned i;
+
+	if (sfs_bufs_ready) {
+		return 0;
+	}
+
+	sfs_buflock = lock_create("sfs_buflock");
+	if (sfs_buflock == NULL) {
+		return ENOMEM;
+	}
+	sfs_bufcv = cv_create("sfs_bufcv");
+	if (sfs_bufcv == NULL) {
+		lock_destroy(sfs_buflock);
+		sfs_buflock = NULL;
+		return ENOMEM;
+	}
+
+	for (i=0; i<SFS_NBUFHASH; i++) {
+		sfs_bufhash[i] = NULL;
+	}
+	sfs_lruhead = sfs_lrutail = NULL;
+	for (i=0; i<SFS_NBUF; i++) {
+		sfs_bufs[i].b_fs = NULL;
+		sfs_bufs[i].b_refcount = 0;
+		sfs_bufs[i].b_valid = false;
+		sfs_bufs[i].b_dirty = false;
+		sfs_bufs[i].b_busy = false;
+		sfs_bufs[i].b_dirtytime = 0;
+		sfs_bufs[i].b_owner = NULL;
+		sfs_bufs[i].b_meta = false;
+		sfs_bufs[i].b_ownnext = sfs_bufs[i].b_ownprev = NULL;
+		sfs_bufs[i].b_hashnext = NULL;
+		sfs_lru_append(&sfs_bufs[i]);
+	}
+	sfs_prefetch_head = sfs_prefetch_count = 0;
+	sfs_bufs_ready = true;
+
+	/* Without the syncer, dirty buffers wait for a sync or reuse */
+	if (thread_fork("sfs_syncer", NULL, sfs_syncer_thread, NULL, 0)) {
+		kprintf("sfs: no write-behind, could not start thread\n");
+	}
+
+	/* Without the thread, read-ahead requests are simply dropped */
+	sfs_prefetch_sem = sem_create("sfs_prefetch", 0);
+	if (sfs_prefetch_sem == NULL) {
+		kprintf("sfs: no read-ahead, out of memory\n");
+		return 0;
+	}
+	if (thread_fork("sfs_prefetch", NULL, sfs_prefetch_thread, NULL, 0)) {
+		kprintf("sfs: no read-ahead, could not start thread\n");
+		sem_destroy(sfs_prefetch_sem);
+		sfs_prefetch_sem = NULL;
+	}
+	return 0;
+}
+
+static
+unsigned
+sfs_bufhashfn(struct sfs_fs *sfs, uint32_t block)
+{
+	return (((uintptr_t)sfs >> 4) ^ block) % SFS_NBUFHASH;
+}
+
+static
+struct sfs_buf *
+sfs_bfind(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+
+	for (b = sfs_bufhash[sfs_bufhashfn(sfs, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_fs == sfs && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/* Take B off its owner's list of dirty buffers */
+static
+void
+sfs_bdetach(struct sfs_buf *b)
+{
+	if (b->b_owner == NULL) {
+		return;
+	}
+	if (b->b_ownprev != NULL) {
+		b->b_ownprev->b_ownnext = b->b_ownnext;
+	}
+	else {
+		b->b_owner->sv_dirtybufs = b->b_ownnext;
+	}
+	if (b->b_ownnext != NULL) {
+		b->b_ownnext->b_ownprev = b->b_ownprev;
+	}
+	b->b_ownnext = b->b_ownprev = NULL;
+	b->b_owner = NULL;
+	b->b_meta = false;
+}
+
+/* Put B on SV's list of dirty buffers */
+static
+void
+sfs_battach(struct sfs_buf *b, struct sfs_vnode *sv, bool meta)
+{
+	if (b->b_owner != sv) {
+		sfs_bdetach(b);
+		b->b_owner = sv;
+		b->b_ownprev = NULL;
+		b->b_ownnext = sv->sv_dirtybufs;
+		if (sv->sv_dirtybufs != NULL) {
+			sv->sv_dirtybufs->b_ownprev = b;
+		}
+		sv->sv_dirtybufs = b;
+	}
+	b->b_meta = meta;
+}
+
+/* Take B out of the hash table, so it holds no block any more */
+static
+void
+sfs_bunhash(struct sfs_buf *b)
+{
+	struct sfs_buf **link;
+
+	KASSERT(b->b_fs != NULL);
+	KASSERT(!b->b_busy);
+
+	link = &sfs_bufhash[sfs_bufhashfn(b->b_fs, b->b_block)];
+	while (*link != b) {
+		KASSERT(*link != NULL);
+		link = &(*link)->b_hashnext;
+	}
+	*link = b->b_hashnext;
+
+	sfs_bdetach(b);
+	b->b_hashnext = NULL;
+	b->b_fs = NULL;
+	b->b_valid = false;
+	b->b_dirty = false;
+}
+
+/*
+ * Transfer N buffers holding consecutive blocks of one filesystem in a
+ * single device request. Written buffers become clean, read ones valid.
+ *
+ * The buffers are marked busy and the cache lock is let go during the
+ * I/O. A buffer dirtied again meanwhile stays dirty.
+ */
+static
+int
+sfs_bcluster(struct sfs_buf **bufs, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[SFS_CLUSTER];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs_buflock));
+	KASSERT(n > 0 && n <= SFS_CLUSTER);
+
+	for (i=0; i<n; i++) {
+		KASSERT(bufs[i]->b_fs == bufs[0]->b_fs);
+		KASSERT(bufs[i]->b_block == bufs[0]->b_block + i);
+		KASSERT(!bufs[i]->b_busy);
+		KASSERT(rw == UIO_READ || bufs[i]->b_dirty);
+		KASSERT(rw == UIO_READ || bufs[i]->b_refcount == 0);
+		bufs[i]->b_busy = true;
+		if (rw == UIO_WRITE) {
+			bufs[i]->b_dirty = false;
+		}
+		iov[i].iov_kbase = bufs[i]->b_data;
+		iov[i].iov_len = SFS_BLOCKSIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = ((off_t)bufs[0]->b_block) * SFS_BLOCKSIZE;
+	ku.uio_resid = n * SFS_BLOCKSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	lock_release(sfs_buflock);
+	result = sfs_rwblock(bufs[0]->b_fs, &ku);
+	lock_acquire(sfs_buflock);
+
+	for (i=0; i<n; i++) {
+		bufs[i]->b_busy = false;
+		if (result && rw == UIO_WRITE) {
+			bufs[i]->b_dirty = true;
+		}
+		else if (result == 0 && rw == UIO_READ) {
+			bufs[i]->b_valid = true;
+		}
+		else if (result == 0 && !bufs[i]->b_dirty) {
+			/* Written, and not changed again since */
+			sfs_bdetach(bufs[i]);
+		}
+	}
+	if (result == 0 && rw == UIO_WRITE) {
+		sfs_bufwrites += n;
+	}
+	cv_broadcast(sfs_bufcv, sfs_buflock);
+	return result;
+}
+
+/* Write a dirty buffer out to disk */
+static
+int
+sfs_bwrite(struct sfs_buf *b)
+{
+	KASSERT(b->b_valid && b->b_dirty);
+
+	return sfs_bcluster(&b, 1, UIO_WRITE);
+}
+
+/*
+ * Find a buffer to reuse: the least recently used one that nobody
+ * holds, and so nobody is changing, written back first if need be.
+ * It comes back out of the hash table; the cache lock may have been
+ * let go in between.
+ */
+static
+int
+sfs_breuse(struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs_buflock));
+
+ again:
+	for (b = sfs_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_refcount > 0 || b->b_busy) {
+			continue;
+		}
+		if (b->b_dirty) {
+			result = sfs_bwrite(b);
+			if (result) {
+				return result;
+			}
+			/* Things may have moved while we were writing */
+			goto again;
+		}
+		if (b->b_fs != NULL) {
+			sfs_bunhash(b);
+		}
+		*ret = b;
+		return 0;
+	}
+
+	/* Every buffer is in use; nested users never hold more than a few */
+	return ENOMEM;
+}
+
+/*
+ * Get a reference to the buffer for BLOCK, which is not busy. Cache
+ * lock held.
+ */
+static
+int
+sfs_bgetx(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	unsigned h;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs_buflock));
+
+ again:
+	b = sfs_bfind(sfs, block);
+	if (b != NULL) {
+		sfs_bufhits++;
+		/* Holding a reference keeps it from being reused */
+		b->b_refcount++;
+		while (b->b_busy) {
+			cv_wait(sfs_bufcv, sfs_buflock);
+		}
+	}
+	else {
+		result = sfs_breuse(&b);
+		if (result) {
+			return result;
+		}
+		/* Someone may have brought the block in meanwhile */
+		if (sfs_bfind(sfs, block) != NULL) {
+			sfs_lru_remove(b);
+			sfs_lru_prepend(b);
+			goto again;
+		}
+		b->b_fs = sfs;
+		b->b_block = block;
+		b->b_valid = false;
+		b->b_dirty = false;
+		h = sfs_bufhashfn(sfs, block);
+		b->b_hashnext = sfs_bufhash[h];
+		sfs_bufhash[h] = b;
+		b->b_refcount = 1;
+	}
+
+	sfs_lru_remove(b);
+	sfs_lru_append(b);
+
+	*ret = b;
+	return 0;
+}
+
+/* Drop a reference, cache lock held */
+static
+void
+sfs_brelsex(struct sfs_buf *b)
+{
+	KASSERT(lock_do_i_hold(sfs_buflock));
+	KASSERT(b->b_refcount > 0);
+
+	b->b_refcount--;
+	if (b->b_refcount > 0) {
+		return;
+	}
+
+	/* A buffer that never got valid contents is of no use to anyone */
+	if (!b->b_valid && !b->b_busy) {
+		sfs_bunhash(b);
+		sfs_lru_remove(b);
+		sfs_lru_prepend(b);
+	}
+
+	/* sfs_binval may be waiting for it */
+	cv_broadcast(sfs_bufcv, sfs_buflock);
+}
+
+/*
+ * Get a reference to the buffer for BLOCK without reading it in. The
+ * caller is expected to overwrite all of it if it is not valid yet.
+ */
+int
+sfs_bget(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	int result;
+
+	lock_acquire(sfs_buflock);
+	result = sfs_bgetx(sfs, block, ret);
+	lock_release(sfs_buflock);
+	return result;
+}
+
+/*
+ * Get a reference to the buffer for BLOCK, reading it in if it is not
+ * in the cache.
+ */
+int
+sfs_bread(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	lock_acquire(sfs_buflock);
+
+	result = sfs_bgetx(sfs, block, &b);
+	if (result) {
+		lock_release(sfs_buflock);
+		return result;
+	}
+
+	if (!b->b_valid) {
+		result = sfs_bcluster(&b, 1, UIO_READ);
+		if (result) {
+			sfs_brelsex(b);
+			lock_release(sfs_buflock);
+			return result;
+		}
+		sfs_bufmisses++;
+	}
+
+	lock_release(sfs_buflock);
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Mark a buffer as changed. Its contents are now what the block
+ * should hold, whether or not it was read in. Call this after making
+ * the changes.
+ */
+static
+void
+sfs_bdirtyx(struct sfs_buf *b)
+{
+	time_t now;
+	uint32_t nsecs;
+
+	KASSERT(lock_do_i_hold(sfs_buflock));
+	KASSERT(b->b_refcount > 0);
+
+	b->b_valid = true;
+	if (!b->b_dirty) {
+		gettime(&now, &nsecs);
+		b->b_dirty = true;
+		b->b_dirtytime = now;
+	}
+}
+
+void
+sfs_bdirty(struct sfs_buf *b)
+{
+	lock_acquire(sfs_buflock);
+	sfs_bdirtyx(b);
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Same, for a block of the file SV: data if not META, or one of its
+ * indirect blocks. It will be written by sfs_bsyncfile.
+ */
+void
+sfs_bdirtyfile(struct sfs_buf *b, struct sfs_vnode *sv, bool meta)
+{
+	lock_acquire(sfs_buflock);
+	sfs_bdirtyx(b);
+	sfs_battach(b, sv, meta);
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Drop a reference gotten from sfs_bget or sfs_bread.
+ */
+void
+sfs_brelse(struct sfs_buf *b)
+{
+	lock_acquire(sfs_buflock);
+	sfs_brelsex(b);
+	lock_release(sfs_buflock);
+}
+
+/*
+ * BLOCK has been freed; its contents no longer need to reach the disk.
+ */
+void
+sfs_bdiscard(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+
+	lock_acquire(sfs_buflock);
+
+	while ((b = sfs_bfind(sfs, block)) != NULL && b->b_busy) {
+		cv_wait(sfs_bufcv, sfs_buflock);
+	}
+	if (b != NULL) {
+		b->b_dirty = false;
+		sfs_bdetach(b);
+		if (b->b_refcount == 0) {
+			sfs_bunhash(b);
+			sfs_lru_remove(b);
+			sfs_lru_prepend(b);
+		}
+	}
+
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Add B to the N buffers in DIRTY, kept sorted by filesystem and block
+ * number so that neighbouring blocks go out together.
+ */
+static
+void
+sfs_bsort_add(struct sfs_buf **dirty, unsigned n, struct sfs_buf *b)
+{
+	unsigned j;
+
+	for (j=n; j>0; j--) {
+		if (dirty[j-1]->b_fs < b->b_fs ||
+		    (dirty[j-1]->b_fs == b->b_fs &&
+		     dirty[j-1]->b_block < b->b_block)) {
+			break;
+		}
+		dirty[j] = dirty[j-1];
+	}
+	dirty[j] = b;
+}
+
+/*
+ * Write out the N sorted buffers in DIRTY, in runs of consecutive
+ * blocks. The lock is let go during each write, so check again that a
+ * buffer still needs writing before sending it. Buffers somebody
+ * holds may be half changed; if WAIT, wait until they are let go,
+ * otherwise leave them. Returns the number of blocks written in
+ * *WRITTEN, if not NULL.
+ */
+static
+int
+sfs_bflush(struct sfs_buf **dirty, unsigned n, bool wait, unsigned *written)
+{
+	struct sfs_buf *b;
+	unsigned i, run, total = 0;
+	int result = 0;
+
+	KASSERT(lock_do_i_hold(sfs_buflock));
+
+	for (i=0; i<n; i+=run) {
+		b = dirty[i];
+		run = 1;
+		while (wait && b->b_dirty && (b->b_refcount > 0 || b->b_busy)) {
+			cv_wait(sfs_bufcv, sfs_buflock);
+		}
+		if (b->b_fs == NULL || !b->b_dirty || b->b_busy ||
+		    b->b_refcount > 0) {
+			continue;
+		}
+		while (i+run < n && run < SFS_CLUSTER &&
+		       dirty[i+run]->b_fs == b->b_fs &&
+		       dirty[i+run]->b_dirty && !dirty[i+run]->b_busy &&
+		       dirty[i+run]->b_refcount == 0 &&
+		       dirty[i+run]->b_block == b->b_block + run) {
+			run++;
+		}
+		result = sfs_bcluster(&dirty[i], run, UIO_WRITE);
+		if (result) {
+			break;
+		}
+		total += run;
+	}
+
+	if (written != NULL) {
+		*written = total;
+	}
+	return result;
+}
+
+/*
+ * Write every dirty buffer of SFS to disk.
+ */
+int
+sfs_bsync(struct sfs_fs *sfs)
+{
+	struct sfs_buf *dirty[SFS_NBUF];
+	struct sfs_buf *b;
+	unsigned i, n;
+	bool busy;
+	int result;
+
+	lock_acquire(sfs_buflock);
+
+	/* Let transfers already going on finish first */
+	do {
+		busy = false;
+		for (i=0; i<SFS_NBUF; i++) {
+			if (sfs_bufs[i].b_fs == sfs && sfs_bufs[i].b_busy) {
+				busy = true;
+				cv_wait(sfs_bufcv, sfs_buflock);
+				break;
+			}
+		}
+	} while (busy);
+
+	n = 0;
+	for (i=0; i<SFS_NBUF; i++) {
+		b = &sfs_bufs[i];
+		if (b->b_fs == sfs && b->b_dirty) {
+			sfs_bsort_add(dirty, n++, b);
+		}
+	}
+	result = sfs_bflush(dirty, n, true, NULL);
+
+	lock_release(sfs_buflock);
+	return result;
+}
+
+/*
+ * Write the dirty buffers of the file SV to disk: its indirect blocks
+ * if META, its data otherwise. SV's lock is held.
+ */
+int
+sfs_bsyncfile(struct sfs_vnode *sv, bool meta)
+{
+	struct sfs_buf *dirty[SFS_NBUF];
+	struct sfs_buf *b;
+	unsigned n;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	lock_acquire(sfs_buflock);
+
+	/* A block being written already may have changed since */
+ again:
+	n = 0;
+	for (b = sv->sv_dirtybufs; b != NULL; b = b->b_ownnext) {
+		if (b->b_meta != meta) {
+			continue;
+		}
+		if (b->b_busy) {
+			cv_wait(sfs_bufcv, sfs_buflock);
+			goto again;
+		}
+		if (b->b_dirty) {
+			sfs_bsort_add(dirty, n++, b);
+		}
+	}
+	result = sfs_bflush(dirty, n, true, NULL);
+
+	lock_release(sfs_buflock);
+	return result;
+}
+
+/*
+ * Write the dirty buffers among the N blocks of SFS starting at BLOCK
+ * to disk.
+ */
+int
+sfs_bsyncrange(struct sfs_fs *sfs, uint32_t block, uint32_t n)
+{
+	struct sfs_buf *dirty[SFS_NBUF];
+	struct sfs_buf *b;
+	unsigned i, ndirty;
+	int result;
+
+	lock_acquire(sfs_buflock);
+
+ again:
+	ndirty = 0;
+	for (i=0; i<SFS_NBUF; i++) {
+		b = &sfs_bufs[i];
+		if (b->b_fs != sfs || b->b_block < block ||
+		    b->b_block - block >= n) {
+			continue;
+		}
+		if (b->b_busy) {
+			cv_wait(sfs_bufcv, sfs_buflock);
+			goto again;
+		}
+		if (b->b_dirty) {
+			sfs_bsort_add(dirty, ndirty++, b);
+		}
+	}
+	result = sfs_bflush(dirty, ndirty, true, NULL);
+
+	lock_release(sfs_buflock);
+	return result;
+}
+
+/*
+ * SV is going away; its dirty buffers are left to be written behind.
+ */
+void
+sfs_bdisown(struct sfs_vnode *sv)
+{
+	lock_acquire(sfs_buflock);
+	while (sv->sv_dirtybufs != NULL) {
+		sfs_bdetach(sv->sv_dirtybufs);
+	}
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Ask for BLOCK to be read into the cache in the background, unless
+ * it is there already.
+ */
+void
+sfs_bprefetch(struct sfs_fs *sfs, uint32_t block)
+{
+	unsigned i, n;
+
+	lock_acquire(sfs_buflock);
+
+	if (sfs_prefetch_sem == NULL || sfs_prefetch_count == SFS_NPREFETCH ||
+	    sfs_bfind(sfs, block) != NULL) {
+		lock_release(sfs_buflock);
+		return;
+	}
+
+	for (n=0; n<sfs_prefetch_count; n++) {
+		i = (sfs_prefetch_head + n) % SFS_NPREFETCH;
+		if (sfs_prefetchq[i].pf_fs == sfs &&
+		    sfs_prefetchq[i].pf_block == block) {
+			lock_release(sfs_buflock);
+			return;
+		}
+	}
+
+	i = (sfs_prefetch_head + sfs_prefetch_count) % SFS_NPREFETCH;
+	sfs_prefetchq[i].pf_fs = sfs;
+	sfs_prefetchq[i].pf_block = block;
+	sfs_prefetch_count++;
+	V(sfs_prefetch_sem);
+
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Read the N buffers gotten for consecutive blocks in as few requests
+ * as possible, and let go of them. Cache lock held.
+ */
+static
+void
+sfs_prefetch_run(struct sfs_buf **bufs, unsigned n)
+{
+	unsigned i, j;
+
+	for (i=0; i<n; i=j) {
+		/* Someone else may have read some of them in meanwhile */
+		if (bufs[i]->b_valid || bufs[i]->b_busy) {
+			j = i+1;
+			continue;
+		}
+		for (j=i+1; j<n && !bufs[j]->b_valid && !bufs[j]->b_busy; j++) {
+			/* nothing */
+		}
+		if (sfs_bcluster(&bufs[i], j-i, UIO_READ) == 0) {
+			sfs_bufprefetches += j-i;
+		}
+	}
+
+	/* Buffers that did not get read are dropped here */
+	for (i=0; i<n; i++) {
+		sfs_brelsex(bufs[i]);
+	}
+}
+
+/*
+ * Read queued blocks in. Requests for consecutive blocks at the head
+ * of the queue are taken together.
+ */
+static
+void
+sfs_prefetch_thread(void *data1, unsigned long data2)
+{
+	struct sfs_buf *bufs[SFS_CLUSTER];
+	struct sfs_fs *sfs;
+	uint32_t block, start;
+	unsigned n, taken;
+
+	(void)data1;
+	(void)data2;
+
+	for (;;) {
+		P(sfs_prefetch_sem);
+
+		lock_acquire(sfs_buflock);
+		/* Requests of an unmounted filesystem are gone already */
+		if (sfs_prefetch_count == 0) {
+			lock_release(sfs_buflock);
+			continue;
+		}
+
+		sfs = sfs_prefetchq[sfs_prefetch_head].pf_fs;
+		start = sfs_prefetchq[sfs_prefetch_head].pf_block;
+		taken = 0;
+		do {
+			sfs_prefetch_head = (sfs_prefetch_head + 1) % SFS_NPREFETCH;
+			sfs_prefetch_count--;
+			taken++;
+		} while (taken < SFS_CLUSTER && sfs_prefetch_count > 0 &&
+			 sfs_prefetchq[sfs_prefetch_head].pf_fs == sfs &&
+			 sfs_prefetchq[sfs_prefetch_head].pf_block == start + taken);
+
+		/* Blocks already in the cache split the run */
+		n = 0;
+		for (block = start; block < start + taken; block++) {
+			if (sfs_bfind(sfs, block) != NULL) {
+				sfs_prefetch_run(bufs, n);
+				n = 0;
+				continue;
+			}
+			if (sfs_bgetx(sfs, block, &bufs[n])) {
+				break;
+			}
+			n++;
+		}
+		sfs_prefetch_run(bufs, n);
+		lock_release(sfs_buflock);
+
+		/* The semaphore counted each request we took */
+		while (--taken > 0) {
+			P(sfs_prefetch_sem);
+		}
+	}
+}
+
+/*
+ * Write dirty buffers behind. Buffers somebody is holding are left for
+ * the next pass.
+ */
+static
+void
+sfs_syncer_thread(void *data1, unsigned long data2)
+{
+	struct sfs_buf *dirty[SFS_NBUF];
+	struct sfs_buf *b;
+	time_t now, lastsync;
+	uint32_t nsecs;
+	unsigned i, n, ndirty, written;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	gettime(&lastsync, &nsecs);
+
+	for (;;) {
+		clocknap(SFS_SYNCTICKS);
+		gettime(&now, &nsecs);
+
+		if (now - lastsync >= SFS_SYNCINTERVAL) {
+			vfs_sync();
+			lastsync = now;
+			continue;
+		}
+
+		lock_acquire(sfs_buflock);
+
+		ndirty = 0;
+		for (i=0; i<SFS_NBUF; i++) {
+			if (sfs_bufs[i].b_dirty) {
+				ndirty++;
+			}
+		}
+
+		n = 0;
+		for (i=0; i<SFS_NBUF; i++) {
+			b = &sfs_bufs[i];
+			if (!b->b_dirty || b->b_busy || b->b_refcount > 0) {
+				continue;
+			}
+			if (ndirty > SFS_WBHIGH ||
+			    now - b->b_dirtytime >= SFS_WBAGE) {
+				sfs_bsort_add(dirty, n++, b);
+			}
+		}
+
+		result = sfs_bflush(dirty, n, false, &written);
+		sfs_bufwritebehind += written;
+
+		lock_release(sfs_buflock);
+
+		if (result) {
+			kprintf("sfs: write-behind: %s\n", strerror(result));
+		}
+	}
+}
+
+/*
+ * Forget every buffer of SFS, which is going away. It must have been
+ * synced, and nobody may be using it any more.
+ */
+void
+sfs_binval(struct sfs_fs *sfs)
+{
+	unsigned i, n, kept;
+	bool inuse;
+
+	if (!sfs_bufs_ready) {
+		return;
+	}
+
+	lock_acquire(sfs_buflock);
+
+	/* Drop its read-ahead requests, keeping the others in order */
+	kept = 0;
+	for (n=0; n<sfs_prefetch_count; n++) {
+		i = (sfs_prefetch_head + n) % SFS_NPREFETCH;
+		if (sfs_prefetchq[i].pf_fs != sfs) {
+			sfs_prefetchq[(sfs_prefetch_head + kept) % SFS_NPREFETCH] =
+				sfs_prefetchq[i];
+			kept++;
+		}
+	}
+	sfs_prefetch_count = kept;
+
+	/* The read-ahead thread may still be reading some of it */
+	do {
+		inuse = false;
+		for (i=0; i<SFS_NBUF; i++) {
+			struct sfs_buf *b = &sfs_bufs[i];
+			if (b->b_fs == sfs && (b->b_refcount > 0 || b->b_busy)) {
+				inuse = true;
+				cv_wait(sfs_bufcv, sfs_buflock);
+				break;
+			}
+		}
+	} while (inuse);
+
+	for (i=0; i<SFS_NBUF; i++) {
+		struct sfs_buf *b = &sfs_bufs[i];
+		if (b->b_fs == sfs) {
+			KASSERT(!b->b_dirty);
+			sfs_bunhash(b);
+			sfs_lru_remove(b);
+			sfs_lru_prepend(b);
+		}
+	}
+
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Print the buffer cache statistics.
+ */
+void
+sfs_bstats(void)
+{
+	unsigned i, used = 0, dirty = 0;
+
+	if (!sfs_bufs_ready) {
+		kprintf("sfs buffer cache: not in use\n");
+		return;
+	}
+
+	lock_acquire(sfs_buflock);
+	for (i=0; i<SFS_NBUF; i++) {
+		if (sfs_bufs[i].b_fs != NULL) {
+			used++;
+		}
+		if (sfs_bufs[i].b_dirty) {
+			dirty++;
+		}
+	}
+	kprintf("sfs buffer cache: %u buffers, %u in use, %u dirty\n",
+		SFS_NBUF, used, dirty);
+	kprintf("    %u hits, %u misses, %u writes, %u read ahead, "
+		"%u written behind\n",
+		sfs_bufhits, sfs_bufmisses, sfs_bufwrites, sfs_bufprefetches,
+		sfs_bufwritebehind);
+	lock_release(sfs_buflock);
+}
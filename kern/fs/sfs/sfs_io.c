@@ -42,15 +42,22 @@
 // Note: sfs_rblock is used to read the superblock
 // early in mount, before sfs is fully (or even mostly)
 // initialized, and so may not use anything from sfs
-// except sfs_device.
+// except sfs_device. The buffer cache only uses the
+// sfs pointer as part of the key.
 
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 {
+	struct iovec iovsave[SFS_CLUSTER];
+	struct uio usave;
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(uio->uio_iovcnt <= SFS_CLUSTER);
+
+	/* The device moves the uio along; a retry has to start over */
+	usave = *uio;
+	memcpy(iovsave, uio->uio_iov, uio->uio_iovcnt * sizeof(struct iovec));
 
 	DEBUG(DB_SFS, "sfs: %s %llu\n", 
 	      uio->uio_rw == UIO_READ ? "read" : "write",
@@ -67,6 +74,9 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 		panic("sfs: d_io returned EINVAL\n");
 	}
 	if (result == EIO) {
+		*uio = usave;
+		memcpy(uio->uio_iov, iovsave,
+		       uio->uio_iovcnt * sizeof(struct iovec));
 		if (tries == 0) {
 			tries++;
 			kprintf("sfs: block %llu I/O error, retrying\n",
@@ -86,22 +96,38 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	return result;
 }
 
+/*
+ * Copy a block in or out of the buffer cache. Writes reach the disk
+ * when the buffer is reused or the filesystem is synced.
+ */
+
 int
 sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *b;
+	int result;
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_bread(sfs, block, &b);
+	if (result) {
+		return result;
+	}
+	memcpy(data, b->b_data, SFS_BLOCKSIZE);
+	sfs_brelse(b);
+	return 0;
 }
 
 int
 sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *b;
+	int result;
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_bget(sfs, block, &b);
+	if (result) {
+		return result;
+	}
+	memcpy(b->b_data, data, SFS_BLOCKSIZE);
+	sfs_bdirty(b);
+	sfs_brelse(b);
+	return 0;
 }
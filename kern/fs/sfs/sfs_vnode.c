@@ -49,18 +49,29 @@
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* With the vnode ops */
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
 
-/* Zero out a disk block. */
+/* Zero out a disk block. No need to read it in first. */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct sfs_buf *b;
+	int result;
+
+	result = sfs_bget(sfs, block, &b);
+	if (result) {
+		return result;
+	}
+	bzero(b->b_data, SFS_BLOCKSIZE);
+	sfs_bdirty(b);
+	sfs_brelse(b);
+	return 0;
 }
 
 /* Write an on-disk inode structure back out to disk. */
@@ -84,26 +95,39 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Allocate a block, the first free one at or after GOAL (wrapping
+ * around to the start of the disk if need be).
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
+	uint32_t nblocks = sfs->sfs_super.sp_nblocks;
+	unsigned block;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	if (goal >= nblocks) {
+		goal = 0;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_findzero(sfs->sfs_freemap, goal, &block);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
-
-	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
-		panic("sfs: balloc: invalid block %u\n", *diskblock);
+	/* mksfs marks the bits past the end of the volume in use */
+	if (block >= nblocks) {
+		panic("sfs: block %u past the end of the volume marked free\n",
+		      block);
 	}
+	bitmap_mark(sfs->sfs_freemap, block);
+	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
+	*diskblock = block;
 
 	/* Clear block before returning it */
-	return sfs_clearblock(sfs, *diskblock);
+	return sfs_clearblock(sfs, block);
 }
 
 /*
@@ -113,8 +137,106 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Whatever was cached for it need not be written any more */
+	sfs_bdiscard(sfs, diskblock);
+}
+
+/*
+ * Preallocation. When a file grows, the blocks right after the one
+ * allocated for it are reserved for it too, so that files written at
+ * the same time do not end up interleaved. Reserved blocks are marked
+ * in the freemap; they are handed back when the vnode goes away or the
+ * file is truncated, or when the file allocates somewhere else.
+ */
+#define SFS_PREALLOC 8
+
+static
+void
+sfs_prealloc_release(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (sv->sv_nprealloc == 0) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (; sv->sv_nprealloc > 0; sv->sv_nprealloc--, sv->sv_prealloc++) {
+		bitmap_unmark(sfs->sfs_freemap, sv->sv_prealloc);
+		sfs->sfs_freemapdirty = true;
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Allocate a block for SV, at GOAL if at all possible. If EXTENDING,
+ * the file is growing and more blocks after this one are reserved.
+ */
+static
+int
+sfs_balloc_file(struct sfs_vnode *sv, uint32_t goal, bool extending,
+		uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t block;
+	unsigned n;
+	int result;
+
+	if (sv->sv_nprealloc > 0 && sv->sv_prealloc == goal) {
+		*diskblock = sv->sv_prealloc++;
+		sv->sv_nprealloc--;
+		return sfs_clearblock(sfs, *diskblock);
+	}
+
+	/* The reservation is of no use if we are not continuing it */
+	sfs_prealloc_release(sv);
+
+	/*
+	 * A growing file gets a whole free run for this block and the
+	 * reservation if there is one, even if it is not right at GOAL.
+	 */
+	if (extending && goal < sfs->sfs_super.sp_nblocks) {
+		lock_acquire(sfs->sfs_freemaplock);
+		result = bitmap_alloc_range(sfs->sfs_freemap, goal,
+					    1 + SFS_PREALLOC, &block);
+		if (result == 0) {
+			sfs->sfs_freemapdirty = true;
+		}
+		lock_release(sfs->sfs_freemaplock);
+		if (result == 0) {
+			KASSERT(block + SFS_PREALLOC < sfs->sfs_super.sp_nblocks);
+			sv->sv_prealloc = block + 1;
+			sv->sv_nprealloc = SFS_PREALLOC;
+			*diskblock = block;
+			return sfs_clearblock(sfs, block);
+		}
+	}
+
+	/* Otherwise take any block, and reserve what follows it */
+	result = sfs_balloc(sfs, goal, diskblock);
+	if (result || !extending) {
+		return result;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (n=0; n<SFS_PREALLOC; n++) {
+		block = *diskblock + 1 + n;
+		if (block >= sfs->sfs_super.sp_nblocks ||
+		    bitmap_isset(sfs->sfs_freemap, block)) {
+			break;
+		}
+		bitmap_mark(sfs->sfs_freemap, block);
+		sfs->sfs_freemapdirty = true;
+	}
+	lock_release(sfs->sfs_freemaplock);
+	sv->sv_prealloc = *diskblock + 1;
+	sv->sv_nprealloc = n;
+	return 0;
 }
 
 /*
@@ -124,11 +246,16 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
@@ -136,32 +263,133 @@ sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 // Block mapping/inode maintenance
 
 /*
- * Look up the disk block number (from 0 up to the number of blocks on
- * the disk) given a file and the logical block number within that
- * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * Look up block INDEX of an indirect tree LEVELS deep (1 for the
+ * single indirect block, up to 3 for the triple) whose top block
+ * number is in *ROOTP, in the inode. If DOALLOC is set, missing
+ * blocks, indirect or data, are allocated, starting at GOAL.
+ *
+ * The last leaf indirect block used (the one pointing to data blocks)
+ * is remembered in the vnode, so that going through a file in order
+ * does not read the upper levels again for every block.
  */
 static
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
-	 uint32_t *diskblock)
+sfs_bmap_tree(struct sfs_vnode *sv, unsigned levels, uint32_t *rootp,
+	      uint32_t index, int doalloc, uint32_t goal, bool extending,
+	      uint32_t *diskblock)
 {
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idb;		/* buffer holding an indirect block */
+	uint32_t *idbuf;
+	uint32_t block, child, slot;
+	uint32_t span;			/* file blocks per entry */
+	unsigned level, i;
+	int result;
+
+	if (sv->sv_leaflevels == levels &&
+	    sv->sv_leafbase == index / SFS_DBPERIDB) {
+		/* Straight to the leaf */
+		block = sv->sv_leafblock;
+		level = 1;
+		span = 1;
+	}
+	else {
+		block = *rootp;
+		if (block == 0) {
+			if (!doalloc) {
+				/*
+				 * There's no tree allocated. We weren't
+				 * asked to allocate anything, so pretend
+				 * it was filled with all zeros.
+				 */
+				*diskblock = 0;
+				return 0;
+			}
+			result = sfs_balloc_file(sv, goal, extending, &block);
+			if (result) {
+				return result;
+			}
+			/* The next block can go right after it */
+			goal = block + 1;
+
+			/* Remember the block we just allocated */
+			*rootp = block;
+			sv->sv_dirty = true;
+		}
+		level = levels;
+		span = 1;
+		for (i=1; i<levels; i++) {
+			span *= SFS_DBPERIDB;
+		}
+	}
+
 	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
+	 * Go down one level at a time. (Indirect blocks we just
+	 * allocated were left zeroed in the buffer cache.)
 	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	for (; level > 0; level--) {
+		result = sfs_bread(sfs, block, &idb);
+		if (result) {
+			return result;
+		}
+		idbuf = (uint32_t *)idb->b_data;
+
+		slot = (index / span) % SFS_DBPERIDB;
+		child = idbuf[slot];
+
+		/* If there's no block there, allocate one */
+		if (child == 0 && doalloc) {
+			result = sfs_balloc_file(sv, goal, extending, &child);
+			if (result) {
+				sfs_brelse(idb);
+				return result;
+			}
+			goal = child + 1;
+
+			/* Remember the block we allocated */
+			idbuf[slot] = child;
+
+			/* The indirect block is now dirty */
+			sfs_bdirtyfile(idb, sv, true);
+		}
+		sfs_brelse(idb);
+
+		if (level == 1) {
+			sv->sv_leaflevels = levels;
+			sv->sv_leafbase = index / SFS_DBPERIDB;
+			sv->sv_leafblock = block;
+		}
+
+		if (child == 0) {
+			*diskblock = 0;
+			return 0;
+		}
+		block = child;
+		span /= SFS_DBPERIDB;
+	}
+
+	*diskblock = block;
+	return 0;
+}
 
+/*
+ * Look up the disk block number of block FILEBLOCK of a file, as
+ * sfs_bmap does. Blocks allocated, if DOALLOC is set, are placed from
+ * GOAL on; EXTENDING says whether they are past the end of the file.
+ */
+static
+int
+sfs_bmapx(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	  uint32_t goal, bool extending, uint32_t *diskblock)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t *rootp;		/* inode's pointer to the tree */
 	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t span;
+	unsigned levels;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB*sizeof(uint32_t)==SFS_BLOCKSIZE);
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,7 +404,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc_file(sv, goal, extending, &block);
 			if (result) {
 				return result;
 			}
@@ -198,95 +426,83 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's not a direct block. Subtract off the number of direct
+	 * blocks, and then the size of each indirect tree in turn
+	 * until we find the one it is in: single, double or triple.
 	 */
-
 	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum > 0) {
+	span = SFS_DBPERIDB;
+	for (levels = 1; levels <= 3; levels++) {
+		if (fileblock < span) {
+			break;
+		}
+		fileblock -= span;
+		span *= SFS_DBPERIDB;
+	}
+	if (levels > 3) {
+		/* Too large for any of them */
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	switch (levels) {
+	    case 1: rootp = &sv->sv_i.sfi_indirect; break;
+	    case 2: rootp = &sv->sv_i.sfi_dindirect; break;
+	    default: rootp = &sv->sv_i.sfi_tindirect; break;
+	}
 
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
+	result = sfs_bmap_tree(sv, levels, rootp, fileblock, doalloc,
+			       goal, extending, &block);
+	if (result) {
+		return result;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
-		}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+	/* Hand back the result and return. */
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: Data block %u (block %u of file %u) marked free\n",
+		      block, fileblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
 
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+/*
+ * Look up the disk block number (from 0 up to the number of blocks on
+ * the disk) given a file and the logical block number within that
+ * file. If DOALLOC is set, and no such block exists, one will be
+ * allocated.
+ */
+static
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	 uint32_t *diskblock)
+{
+	uint32_t goal, prev;
+	bool extending;
+	int result;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+	/* Most writes go to blocks that exist already */
+	result = sfs_bmapx(sv, fileblock, 0, 0, false, diskblock);
+	if (result || *diskblock != 0 || !doalloc) {
+		return result;
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
-
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+	/*
+	 * We have to allocate, so work out where: right after the
+	 * previous block of the file, or else right after the inode.
+	 */
+	goal = sv->sv_ino + 1;
+	if (fileblock > 0) {
+		result = sfs_bmapx(sv, fileblock-1, 0, 0, false, &prev);
 		if (result) {
 			return result;
 		}
-
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
+		if (prev != 0) {
+			goal = prev + 1;
 		}
 	}
+	extending = fileblock >= DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
 
-	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: Data block %u (block %u of file %u) marked free\n",
-		      block, fileblock, sv->sv_ino);
-	}
-	*diskblock = block;
-	return 0;
+	return sfs_bmapx(sv, fileblock, 1, goal, extending, diskblock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -308,16 +524,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *b;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -339,40 +547,32 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * It reads as zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_bread(sfs, diskblock, &b);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * If it was a write, the buffer is dirty, even if uiomove only
+	 * got part of the way.
 	 */
+	result = uiomove(b->b_data+skipstart, len, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		sfs_bdirtyfile(b, sv, false);
 	}
+	sfs_brelse(b);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -383,14 +583,11 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *b;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
 	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -412,34 +609,91 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
 
 	/*
-	 * Temporarily set the residue to be one block size.
+	 * Go through the buffer cache. A block that is about to be
+	 * overwritten entirely need not be read in first.
 	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_bread(sfs, diskblock, &b);
+	}
+	else {
+		result = sfs_bget(sfs, diskblock, &b);
+	}
+	if (result) {
+		return result;
+	}
+
+	result = uiomove(b->b_data, SFS_BLOCKSIZE, uio);
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
+	 * If a write failed part way through a block we had not read,
+	 * the buffer holds garbage; sfs_brelse drops it.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	if (uio->uio_rw == UIO_WRITE && (result == 0 || b->b_valid)) {
+		sfs_bdirtyfile(b, sv, false);
+	}
+	sfs_brelse(b);
 
 	return result;
 }
 
+/*
+ * Read-ahead. A read that starts where the previous one ended is taken
+ * to be sequential, and the blocks following it are queued to be read
+ * into the buffer cache in the background. The window of blocks read
+ * ahead doubles with each sequential read, up to SFS_RAMAX; any other
+ * read closes it again.
+ */
+#define SFS_RAMIN 2
+#define SFS_RAMAX 16
+
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t start, off_t end)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t fileblock, lastblock, diskblock;
+
+	if (start != sv->sv_raoffset) {
+		sv->sv_rawindow = 0;
+		sv->sv_ranext = 0;
+	}
+	else if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RAMIN;
+	}
+	else if (sv->sv_rawindow < SFS_RAMAX) {
+		sv->sv_rawindow *= 2;
+	}
+	sv->sv_raoffset = end;
+
+	if (sv->sv_rawindow == 0) {
+		return;
+	}
+
+	fileblock = end / SFS_BLOCKSIZE;
+	lastblock = fileblock + sv->sv_rawindow;
+	if (lastblock > DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE)) {
+		lastblock = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	}
+	if (fileblock < sv->sv_ranext) {
+		/* Already queued by an earlier read */
+		fileblock = sv->sv_ranext;
+	}
+
+	for (; fileblock < lastblock; fileblock++) {
+		if (sfs_bmap(sv, fileblock, 0, &diskblock)) {
+			break;
+		}
+		/* Holes read as zeros without touching the disk */
+		if (diskblock != 0) {
+			sfs_bprefetch(sfs, diskblock);
+		}
+	}
+	sv->sv_ranext = fileblock;
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  */
@@ -451,6 +705,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t extraresid = 0;
+	off_t start = uio->uio_offset;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -534,6 +789,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sv->sv_dirty = true;
 	}
 
+	if (uio->uio_rw == UIO_READ && result == 0) {
+		sfs_readahead(sv, start, uio->uio_offset);
+	}
+
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -570,15 +829,258 @@ sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 		return result;
 	}
 
-	/* We should not hit EOF in the middle of a directory entry */
-	if (ku.uio_resid > 0) {
-		panic("sfs: readdir: Short entry (inode %u)\n", sv->sv_ino);
+	/* We should not hit EOF in the middle of a directory entry */
+	if (ku.uio_resid > 0) {
+		panic("sfs: readdir: Short entry (inode %u)\n", sv->sv_ino);
+	}
+
+	/* Done */
+	return 0;
+}
+
+/*
+ * Compute the number of entries in a directory.
+ * This actually computes the number of existing slots, and does not
+ * account for empty slots.
+ */
+static
+int
+sfs_dir_nentries(struct sfs_vnode *sv)
+{
+	off_t size;
+
+	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+
+	size = sv->sv_i.sfi_size;
+	if (size % sizeof(struct sfs_dir) != 0) {
+		panic("sfs: directory %u: Invalid size %llu\n",
+		      sv->sv_ino, size);
+	}
+
+	return size / sizeof(struct sfs_dir);
+}
+
+/*
+ * In-memory index of a directory: its entries by name through a hash
+ * table, and by slot. It is built the first time the directory is
+ * searched and kept up to date by sfs_writedir, so that lookups and
+ * creates need not read the whole directory. If it cannot be kept up
+ * to date it is thrown away, to be built again when next needed.
+ */
+#define SFS_DIRHASH_BUCKETS 256
+
+struct sfs_dirent {
+	char de_name[SFS_NAMELEN];	/* Filename */
+	uint32_t de_ino;		/* Inode number */
+	int de_slot;			/* Slot in the directory */
+	struct sfs_dirent *de_next;	/* Hash chain */
+};
+
+struct sfs_dirhash {
+	struct sfs_dirent *dh_buckets[SFS_DIRHASH_BUCKETS];
+	struct sfs_dirent **dh_slots;	/* Entry in each slot, NULL if free */
+	int dh_nslots;			/* Slots in the directory */
+	int dh_maxslots;		/* Room in dh_slots */
+	int dh_freehint;		/* No free slot below this one */
+};
+
+static
+unsigned
+sfs_dirhash_fn(const char *name)
+{
+	unsigned h = 5381;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h % SFS_DIRHASH_BUCKETS;
+}
+
+static
+void
+sfs_dirhash_destroy(struct sfs_vnode *sv)
+{
+	struct sfs_dirhash *dh = sv->sv_dirhash;
+	int i;
+
+	if (dh == NULL) {
+		return;
+	}
+	for (i=0; i<dh->dh_nslots; i++) {
+		if (dh->dh_slots[i] != NULL) {
+			kfree(dh->dh_slots[i]);
+		}
+	}
+	if (dh->dh_slots != NULL) {
+		kfree(dh->dh_slots);
+	}
+	kfree(dh);
+	sv->sv_dirhash = NULL;
+}
+
+/*
+ * Make sure the index has at least NSLOTS slots; new ones are free.
+ */
+static
+int
+sfs_dirhash_grow(struct sfs_dirhash *dh, int nslots)
+{
+	struct sfs_dirent **newslots;
+	int newmax, i;
+
+	if (nslots > dh->dh_maxslots) {
+		newmax = dh->dh_maxslots < 16 ? 16 : dh->dh_maxslots;
+		while (newmax < nslots) {
+			newmax *= 2;
+		}
+		newslots = kmalloc(newmax * sizeof(struct sfs_dirent *));
+		if (newslots == NULL) {
+			return ENOMEM;
+		}
+		for (i=0; i<dh->dh_nslots; i++) {
+			newslots[i] = dh->dh_slots[i];
+		}
+		if (dh->dh_slots != NULL) {
+			kfree(dh->dh_slots);
+		}
+		dh->dh_slots = newslots;
+		dh->dh_maxslots = newmax;
+	}
+	for (i=dh->dh_nslots; i<nslots; i++) {
+		dh->dh_slots[i] = NULL;
+	}
+	if (nslots > dh->dh_nslots) {
+		dh->dh_nslots = nslots;
+	}
+	return 0;
+}
+
+/*
+ * Record that SLOT holds SD, which is not an empty entry.
+ */
+static
+int
+sfs_dirhash_add(struct sfs_dirhash *dh, const struct sfs_dir *sd, int slot)
+{
+	struct sfs_dirent *de;
+	unsigned h;
+
+	KASSERT(slot < dh->dh_nslots);
+	KASSERT(dh->dh_slots[slot] == NULL);
+	KASSERT(sd->sfd_ino != SFS_NOINO);
+
+	de = kmalloc(sizeof(struct sfs_dirent));
+	if (de == NULL) {
+		return ENOMEM;
+	}
+	memcpy(de->de_name, sd->sfd_name, sizeof(de->de_name));
+	de->de_name[sizeof(de->de_name)-1] = 0;
+	de->de_ino = sd->sfd_ino;
+	de->de_slot = slot;
+
+	h = sfs_dirhash_fn(de->de_name);
+	de->de_next = dh->dh_buckets[h];
+	dh->dh_buckets[h] = de;
+	dh->dh_slots[slot] = de;
+	return 0;
+}
+
+/*
+ * Record that SLOT is now free.
+ */
+static
+void
+sfs_dirhash_remove(struct sfs_dirhash *dh, int slot)
+{
+	struct sfs_dirent **link, *de;
+
+	KASSERT(slot < dh->dh_nslots);
+
+	de = dh->dh_slots[slot];
+	if (de == NULL) {
+		return;
+	}
+
+	link = &dh->dh_buckets[sfs_dirhash_fn(de->de_name)];
+	while (*link != de) {
+		KASSERT(*link != NULL);
+		link = &(*link)->de_next;
+	}
+	*link = de->de_next;
+
+	kfree(de);
+	dh->dh_slots[slot] = NULL;
+	if (slot < dh->dh_freehint) {
+		dh->dh_freehint = slot;
+	}
+}
+
+/*
+ * Get the index of directory SV, reading the directory to build it if
+ * there is none yet.
+ */
+static
+int
+sfs_dirhash_get(struct sfs_vnode *sv, struct sfs_dirhash **ret)
+{
+	struct sfs_dirhash *dh;
+	struct sfs_dir tsd;
+	int nentries = sfs_dir_nentries(sv);
+	int i, result;
+
+	if (sv->sv_dirhash != NULL) {
+		*ret = sv->sv_dirhash;
+		return 0;
+	}
+
+	dh = kmalloc(sizeof(struct sfs_dirhash));
+	if (dh == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_DIRHASH_BUCKETS; i++) {
+		dh->dh_buckets[i] = NULL;
+	}
+	dh->dh_slots = NULL;
+	dh->dh_nslots = 0;
+	dh->dh_maxslots = 0;
+	dh->dh_freehint = 0;
+	sv->sv_dirhash = dh;
+
+	result = sfs_dirhash_grow(dh, nentries);
+	if (result) {
+		sfs_dirhash_destroy(sv);
+		return result;
+	}
+
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, &tsd, i);
+		if (result == 0 && tsd.sfd_ino != SFS_NOINO) {
+			result = sfs_dirhash_add(dh, &tsd, i);
+		}
+		if (result) {
+			sfs_dirhash_destroy(sv);
+			return result;
+		}
 	}
 
-	/* Done */
+	*ret = dh;
 	return 0;
 }
 
+/*
+ * Find a free slot, or return -1 if every slot is in use.
+ */
+static
+int
+sfs_dirhash_freeslot(struct sfs_dirhash *dh)
+{
+	while (dh->dh_freehint < dh->dh_nslots &&
+	       dh->dh_slots[dh->dh_freehint] != NULL) {
+		dh->dh_freehint++;
+	}
+	return dh->dh_freehint < dh->dh_nslots ? dh->dh_freehint : -1;
+}
+
 /*
  * Write (overwrite) the directory entry in slot SLOT of a directory
  * vnode.
@@ -610,30 +1112,23 @@ sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
 	}
 
-	/* Done */
-	return 0;
-}
-
-/*
- * Compute the number of entries in a directory.
- * This actually computes the number of existing slots, and does not
- * account for empty slots.
- */
-static
-int
-sfs_dir_nentries(struct sfs_vnode *sv)
-{
-	off_t size;
-
-	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
-
-	size = sv->sv_i.sfi_size;
-	if (size % sizeof(struct sfs_dir) != 0) {
-		panic("sfs: directory %u: Invalid size %llu\n",
-		      sv->sv_ino, size);
+	/* Keep the index up to date, or drop it if we can't */
+	if (sv->sv_dirhash != NULL) {
+		result = sfs_dirhash_grow(sv->sv_dirhash, slot+1);
+		if (result == 0) {
+			sfs_dirhash_remove(sv->sv_dirhash, slot);
+			if (sd->sfd_ino != SFS_NOINO) {
+				result = sfs_dirhash_add(sv->sv_dirhash, sd,
+							 slot);
+			}
+		}
+		if (result) {
+			sfs_dirhash_destroy(sv);
+		}
 	}
 
-	return size / sizeof(struct sfs_dir);
+	/* Done */
+	return 0;
 }
 
 /*
@@ -647,45 +1142,37 @@ int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		    uint32_t *ino, int *slot, int *emptyslot)
 {
-	struct sfs_dir tsd;
-	int found = 0;
-	int nentries = sfs_dir_nentries(sv);
+	struct sfs_dirhash *dh;
+	struct sfs_dirent *de;
 	int i, result;
 
-	/* For each slot... */
-	for (i=0; i<nentries; i++) {
+	result = sfs_dirhash_get(sv, &dh);
+	if (result) {
+		return result;
+	}
 
-		/* Read the entry from that slot */
-		result = sfs_readdir(sv, &tsd, i);
-		if (result) {
-			return result;
-		}
-		if (tsd.sfd_ino == SFS_NOINO) {
-			/* Free slot - report it back if one was requested */
-			if (emptyslot != NULL) {
-				*emptyslot = i;
-			}
+	/* Free slot - report it back if one was requested */
+	if (emptyslot != NULL) {
+		i = sfs_dirhash_freeslot(dh);
+		if (i >= 0) {
+			*emptyslot = i;
 		}
-		else {
-			/* Ensure null termination, just in case */
-			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
-			if (!strcmp(tsd.sfd_name, name)) {
-
-				/* Each name may legally appear only once... */
-				KASSERT(found==0);
+	}
 
-				found = 1;
-				if (slot != NULL) {
-					*slot = i;
-				}
-				if (ino != NULL) {
-					*ino = tsd.sfd_ino;
-				}
+	for (de = dh->dh_buckets[sfs_dirhash_fn(name)]; de != NULL;
+	     de = de->de_next) {
+		if (!strcmp(de->de_name, name)) {
+			if (slot != NULL) {
+				*slot = de->de_slot;
+			}
+			if (ino != NULL) {
+				*ino = de->de_ino;
 			}
+			return 0;
 		}
 	}
 
-	return found ? 0 : ENOENT;
+	return ENOENT;
 }
 
 /*
@@ -791,17 +1278,19 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
  */
 static
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, int type, uint32_t near,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
 
 	/*
 	 * First, get an inode. (Each inode is a block, and the inode 
-	 * number is the block number, so just get a block.)
+	 * number is the block number, so just get a block.) Put it
+	 * near NEAR, the directory it goes in.
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, near, &ino);
 	if (result) {
 		return result;
 	}
@@ -813,6 +1302,84 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	return sfs_loadvnode(sfs, ino, type, ret);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Table of loaded vnodes
+//
+// Each loaded vnode is in sfs_vnodes, for going over all of them, and
+// in the sfs_vnhash chain for its inode number, for finding one. It
+// remembers its place in sfs_vnodes so it can be taken out of there
+// without a search.
+
+static
+unsigned
+sfs_vnhash_fn(uint32_t ino)
+{
+	return ino % SFS_VNHASH;
+}
+
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	for (sv = sfs->sfs_vnhash[sfs_vnhash_fn(ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+static
+int
+sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h = sfs_vnhash_fn(sv->sv_ino);
+	int result;
+
+	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, &sv->sv_index);
+	if (result) {
+		return result;
+	}
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+	return 0;
+}
+
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **link;
+	struct sfs_vnode *last;
+	unsigned num;
+
+	link = &sfs->sfs_vnhash[sfs_vnhash_fn(sv->sv_ino)];
+	while (*link != sv) {
+		if (*link == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
+		}
+		link = &(*link)->sv_hashnext;
+	}
+	*link = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+	sfs->sfs_vnremoved++;
+
+	/* Move the last vnode into the hole */
+	num = vnodearray_num(sfs->sfs_vnodes);
+	KASSERT(sv->sv_index < num);
+	KASSERT(vnodearray_get(sfs->sfs_vnodes, sv->sv_index) == &sv->sv_v);
+	last = vnodearray_get(sfs->sfs_vnodes, num-1)->vn_data;
+	vnodearray_set(sfs->sfs_vnodes, sv->sv_index, &last->sv_v);
+	last->sv_index = sv->sv_index;
+	/* Shrinking cannot fail */
+	vnodearray_setsize(sfs->sfs_vnodes, num-1);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Vnode ops
@@ -890,68 +1457,71 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/*
-	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * Write it back while it can still be found, so that nobody
+	 * loading it afresh from disk sees an old inode.
 	 */
-	if (v->vn_refcount != 1) {
-
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
-
-		vfs_biglock_release();
-		return EBUSY;
-	}
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_dotruncate(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 	}
 
+	/* Hand back blocks reserved for it and never used */
+	sfs_prealloc_release(sv);
+
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
+	/*
+	 * Make sure someone else hasn't picked up the vnode since the
+	 * decision was made to reclaim it. sfs_loadvnode hands out
+	 * references only while holding sfs_vnlock.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount>1);
+		v->vn_refcount--;
+
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		return EBUSY;
+	}
+	spinlock_release(&v->vn_countlock);
+
+	/* Remove the vnode structure from the tables in the struct sfs_fs. */
+	sfs_vnhash_remove(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
+
 	/* If there are no on-disk references, discard the inode */
 	if (sv->sv_i.sfi_linkcount==0) {
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_dirhash_destroy(sv);
+	sfs_bdisown(sv);
 
+	/* Nobody else can get at it any more */
+	lock_release(sv->sv_lock);
+	lock_destroy(sv->sv_lock);
 	VOP_CLEANUP(&sv->sv_v);
 
-	vfs_biglock_release();
-
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
 
@@ -971,9 +1541,9 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -990,9 +1560,9 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -1033,7 +1603,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +1625,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type does not change once loaded; no lock needed */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1094,62 +1663,168 @@ sfs_tryseek(struct vnode *v, off_t pos)
 /*
  * Called for fsync(), and also on filesystem unmount, global sync(),
  * and some other cases.
+ *
+ * Only this file's blocks are written, in an order that never leaves
+ * the disk pointing at something not there yet: the data, then the
+ * freemap, so blocks the file was given are marked in use, then the
+ * indirect block, then the inode.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
+
+	result = sfs_bsyncfile(sv, false);
+	if (result) {
+		goto out;
+	}
+	result = sfs_syncmap(sfs);
+	if (result) {
+		goto out;
+	}
+	result = sfs_bsyncfile(sv, true);
+	if (result) {
+		goto out;
+	}
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	if (result) {
+		goto out;
+	}
+	result = sfs_bsyncrange(sfs, sv->sv_ino, 1);
 
+ out:
+	lock_release(sv->sv_lock);
 	return result;
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Any range of a regular file can be mapped; pages
+ * past EOF read as zeros and are not written back.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v, off_t offset, size_t len)
 {
 	(void)v;
-	return EUNIMP;
+	(void)len;
+
+	if (offset < 0) {
+		return EINVAL;
+	}
+
+	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Free what is at or past file block BLOCKLEN under the indirect block
+ * *BLOCKP: the root of a tree LEVELS deep whose first entry covers
+ * file block BASE, each entry covering SPAN file blocks. If nothing
+ * is left under it, free the indirect block too, clear *BLOCKP, and
+ * set *CHANGED.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_truncate_tree(struct sfs_vnode *sv, uint32_t *blockp, unsigned levels,
+		  uint32_t base, uint32_t span, uint32_t blocklen,
+		  bool *changed)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idb;		/* buffer holding the indirect block */
+	uint32_t *idbuf;
+	uint32_t j;
+	bool hasnonzero, iddirty;
+	int result;
 
-	struct sfs_vnode *sv = v->vn_data;
+	/* Nothing there, or nothing past the new EOF */
+	if (*blockp == 0 || base + span*SFS_DBPERIDB <= blocklen) {
+		return 0;
+	}
+
+	/* Read the indirect block */
+	result = sfs_bread(sfs, *blockp, &idb);
+	if (result) {
+		return result;
+	}
+	idbuf = (uint32_t *)idb->b_data;
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (idbuf[j] == 0) {
+			continue;
+		}
+		if (levels > 1) {
+			/* Go down a level */
+			result = sfs_truncate_tree(sv, &idbuf[j], levels-1,
+						   base + j*span,
+						   span / SFS_DBPERIDB,
+						   blocklen, &iddirty);
+			if (result) {
+				if (iddirty) {
+					sfs_bdirtyfile(idb, sv, true);
+				}
+				sfs_brelse(idb);
+				return result;
+			}
+		}
+		else if (base + j >= blocklen) {
+			/* Discard any blocks that are past the new EOF */
+			sfs_bfree(sfs, idbuf[j]);
+			idbuf[j] = 0;
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idbuf[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_brelse(idb);
+		sfs_bfree(sfs, *blockp);
+		*blockp = 0;
+		*changed = true;
+		return 0;
+	}
+
+	if (iddirty) {
+		/* The indirect block is dirty */
+		sfs_bdirtyfile(idb, sv, true);
+	}
+	sfs_brelse(idb);
+	return 0;
+}
+
+/*
+ * Truncate SV to LEN bytes; SV's lock is held. Used by sfs_truncate
+ * and sfs_reclaim.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t *roots[3];
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	uint32_t i, block;
+	uint32_t base, span;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	sfs_prealloc_release(sv);
 
-	vfs_biglock_acquire();
+	/* Indirect blocks may be freed */
+	sv->sv_leaflevels = 0;
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1164,54 +1839,20 @@ sfs_truncate(struct vnode *v, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
+	/* Then the single, double and triple indirect trees */
+	roots[0] = &sv->sv_i.sfi_indirect;
+	roots[1] = &sv->sv_i.sfi_dindirect;
+	roots[2] = &sv->sv_i.sfi_tindirect;
+	base = SFS_NDIRECT;
+	span = 1;
+	for (i=0; i<3; i++) {
+		result = sfs_truncate_tree(sv, roots[i], i+1, base, span,
+					   blocklen, &sv->sv_dirty);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+		base += span * SFS_DBPERIDB;
+		span *= SFS_DBPERIDB;
 	}
 
 	/* Set the file size */
@@ -1220,10 +1861,26 @@ sfs_truncate(struct vnode *v, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	lock_release(sv->sv_lock);
+
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1259,18 +1916,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -1278,18 +1935,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, SFS_TYPE_FILE, sv->sv_ino, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1300,19 +1957,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1331,20 +1990,26 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	if (f != sv) {
+		lock_acquire(f->sv_lock);
+	}
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	if (f != sv) {
+		lock_release(f->sv_lock);
+	}
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1360,12 +2025,12 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1373,15 +2038,17 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
 	}
 
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return result;
 }
 
@@ -1401,21 +2068,23 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* We don't support subdirectories */
 	KASSERT(g1->sv_i.sfi_type == SFS_TYPE_FILE);
 
+	lock_acquire(g1->sv_lock);
+
 	/*
 	 * Link it under the new name.
 	 *
@@ -1448,9 +2117,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_dirty = true;
 
 	/* Let go of the reference to g1 */
+	lock_release(g1->sv_lock);
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 
  puke_harder:
@@ -1467,8 +2137,9 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_i.sfi_linkcount--;
  puke:
 	/* Let go of the reference to g1 */
+	lock_release(g1->sv_lock);
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return result;
 }
 
@@ -1486,15 +2157,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2169,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +2186,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 	
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1645,43 +2308,46 @@ static const struct vnode_ops sfs_dirops = {
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
+ *
+ * The inode is read without sfs_vnlock held, so that lookups of other
+ * vnodes need not wait for the disk. Someone else may load the same
+ * inode meanwhile, in which case theirs is used. Or a vnode for it may
+ * be reclaimed meanwhile, which writes the inode back, in which case
+ * it is read again.
  */
 static
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
-	struct sfs_vnode *sv;
+	struct sfs_vnode *sv, *other;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
+	unsigned removed;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	/* Nobody may add or reclaim a vnode while we look */
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
 			      sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_v);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
+	removed = sfs->sfs_vnremoved;
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Didn't have it loaded; load it */
 
@@ -1689,6 +2355,11 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (sv==NULL) {
 		return ENOMEM;
 	}
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		return ENOMEM;
+	}
 
 	/* Must be in an allocated block */
 	if (!sfs_bused(sfs, ino)) {
@@ -1696,11 +2367,35 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      ino);
 	}
 
-	/* Read the block the inode is in */
-	result = sfs_rblock(sfs, &sv->sv_i, ino);
-	if (result) {
-		kfree(sv);
-		return result;
+	for (;;) {
+		/* Read the block the inode is in */
+		result = sfs_rblock(sfs, &sv->sv_i, ino);
+		if (result) {
+			lock_destroy(sv->sv_lock);
+			kfree(sv);
+			return result;
+		}
+
+		lock_acquire(sfs->sfs_vnlock);
+
+		/* Someone else loaded it first; use theirs */
+		other = sfs_vnhash_find(sfs, ino);
+		if (other != NULL) {
+			KASSERT(forcetype==SFS_TYPE_INVAL);
+			VOP_INCREF(&other->sv_v);
+			lock_release(sfs->sfs_vnlock);
+			lock_destroy(sv->sv_lock);
+			kfree(sv);
+			*ret = other;
+			return 0;
+		}
+
+		/* What we read may be older than what a reclaim wrote */
+		if (removed == sfs->sfs_vnremoved) {
+			break;
+		}
+		removed = sfs->sfs_vnremoved;
+		lock_release(sfs->sfs_vnlock);
 	}
 
 	/* Not dirty yet */
@@ -1736,20 +2431,35 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_raoffset = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_ranext = 0;
+	sv->sv_prealloc = 0;
+	sv->sv_nprealloc = 0;
+	sv->sv_dirhash = NULL;
+	sv->sv_dirtybufs = NULL;
+	sv->sv_leaflevels = 0;
+	sv->sv_leafbase = 0;
+	sv->sv_leafblock = 0;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
+	result = sfs_vnhash_add(sfs, sv);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
+		lock_release(sfs->sfs_vnlock);
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -1767,14 +2477,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
@@ -40,6 +40,35 @@
 struct vnode;
 
 
+#if OPT_A3
+
+/*
+ * Where the initialized part of a segment lives in the executable.
+ * Pages are read in from there by vm_fault on first touch; anything
+ * past FILESIZE is zero-filled.
+ */
+struct segment_source {
+  vaddr_t vaddr;    // where the file contents start in memory (not page-aligned)
+  off_t offset;     // where they start in the executable
+  size_t filesize;  // how many bytes come from the file
+};
+
+/*
+ * A range of valid user addresses. An address space has any number of
+ * them, in a list.
+ */
+struct region {
+  vaddr_t rg_vbase;
+  size_t rg_npages;
+  bool rg_writeable;
+  struct segment_source rg_source; // filesize is 0 if nothing comes from the executable
+  struct vnode *rg_file; // file mapped by mmap, rg_source then refers to it
+  bool rg_shared; // changes to the mapping are written back to rg_file
+  struct region *rg_next;
+};
+
+#endif
+
 /* 
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -50,14 +79,17 @@ struct vnode;
 struct addrspace {
 
 #if OPT_A3
-  vaddr_t as_vbase1;
-  struct pagetable_entry *as_pbase1;
-  size_t as_npages1;
-  vaddr_t as_vbase2;
-  struct pagetable_entry *as_pbase2;
-  size_t as_npages2;
-  struct pagetable_entry *as_stackpbase;
+  struct region *as_regions;
+  struct region *as_stack; // one of as_regions, grows down on fault
+  struct region *as_heap; // one of as_regions, moved by sbrk
+  vaddr_t as_heap_break; // current end of the heap, not page-aligned
+  struct pagetable_entry **as_pagetable; // PT_L1_ENTRIES second-level tables
   bool elf_loaded;
+  struct vnode *as_vnode; // executable that text/data are paged in from
+  unsigned as_asid; // tags this address space's TLB entries
+  unsigned as_asid_generation; // as_asid is only valid in this ASID generation
+  uint32_t as_tlbcpus; // CPUs whose TLB may hold entries tagged as_asid
+  struct addrspace *as_next; // on the list of every address space, for eviction
 #else  
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
@@ -103,6 +135,26 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_source - record where in executable V the contents of
+ *                the segment at VADDR come from, so they can be
+ *                paged in on demand instead of read in up front.
+ *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes and hand back
+ *                where it was. Pages given up are freed right away,
+ *                new ones are zero-filled on first touch.
+ *
+ *    as_mmap   - map LEN bytes of file V from OFFSET at an address of
+ *                the kernel's choosing, paged in on demand. Changes to
+ *                a SHARED mapping go back to the file on as_msync,
+ *                as_munmap and as_destroy, and earlier when memory
+ *                runs short.
+ *
+ *    as_munmap - remove the whole mapping at VADDR.
+ *
+ *    as_msync  - write the changed pages of shared mappings within
+ *                VADDR..VADDR+LEN back to their files. Fails with
+ *                ENOMEM if nothing is mapped in that range.
  */
 
 struct addrspace *as_create(void);
@@ -119,6 +171,18 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr, char **args, unsigned long nargs);
+#if OPT_A3
+int               as_define_source(struct addrspace *as, struct vnode *v,
+                                   off_t offset, vaddr_t vaddr,
+                                   size_t filesize);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, struct vnode *v,
+                          off_t offset, size_t len, bool writeable,
+                          bool shared, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_msync(struct addrspace *as, vaddr_t vaddr, size_t len);
+#endif
 
 
 /*
@@ -38,6 +38,12 @@
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *                      Each search starts after the bit last allocated.
+ *     bitmap_alloc_range - locate N contiguous cleared bits at or after
+ *                      a starting index (wrapping around), set them, and
+ *                      return the index of the first.
+ *     bitmap_findzero - return the index of the first cleared bit at or
+ *                      after a starting index (wrapping around).
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
@@ -50,6 +56,10 @@ struct bitmap;  /* Opaque. */
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_range(struct bitmap *, unsigned start, unsigned n,
+                                  unsigned *index);
+int            bitmap_findzero(struct bitmap *, unsigned start,
+                               unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
 int            bitmap_isset(struct bitmap *, unsigned index);
@@ -37,6 +37,7 @@
  */
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
@@ -49,6 +50,10 @@
 
 #endif
 
+#if OPT_A3
+#include <limits.h>
+#endif
+
 
 struct addrspace;
 struct vnode;
@@ -90,6 +95,16 @@ struct proc {
 	struct array *children;
 	struct array *child_live;
 #endif
+#if OPT_A3
+	/*
+	 * Files opened with open(), indexed by descriptor, with the
+	 * O_ACCMODE bits they were opened with. Descriptors 0-2 are
+	 * the console and are never in here. Only the process's one
+	 * thread touches the table, so it needs no lock.
+	 */
+	struct vnode *p_files[OPEN_MAX];
+	int p_fileflags[OPEN_MAX];
+#endif
 
 };
 
@@ -123,5 +138,10 @@ struct addrspace *curproc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *curproc_setas(struct addrspace *);
 
+#if OPT_A3
+/* Give a new process references to all of another's open files. */
+void proc_copyfiles(struct proc *from, struct proc *to);
+#endif
+
 
 #endif /* _PROC_H_ */
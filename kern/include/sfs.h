@@ -48,11 +48,29 @@
  */
 #include <kern/sfs.h>
 
+struct sfs_dirhash;	/* private to sfs_vnode.c */
+
+/* Number of hash chains for loaded vnodes */
+#define SFS_VNHASH 64
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	off_t sv_raoffset;              /* where the last read ended */
+	uint32_t sv_rawindow;           /* blocks to read ahead, 0 if none */
+	uint32_t sv_ranext;             /* first file block not read ahead */
+	uint32_t sv_prealloc;           /* first block reserved past EOF */
+	uint32_t sv_nprealloc;          /* number of blocks reserved */
+	struct sfs_dirhash *sv_dirhash; /* directory index, if built */
+	unsigned sv_index;              /* where it is in sfs_vnodes */
+	struct sfs_vnode *sv_hashnext;  /* chain in sfs_vnhash */
+	struct sfs_buf *sv_dirtybufs;   /* its dirty buffers */
+	unsigned sv_leaflevels;         /* indirect tree of the cached leaf */
+	uint32_t sv_leafbase;           /* which leaf of that tree it is */
+	uint32_t sv_leafblock;          /* disk block of that leaf */
+	struct lock *sv_lock;           /* protects all of the above */
 };
 
 struct sfs_fs {
@@ -61,8 +79,41 @@ struct sfs_fs {
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASH]; /* same, by inode number */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct lock *sfs_vnlock;        /* protects sfs_vnodes and sfs_vnhash */
+	unsigned sfs_vnremoved;         /* vnodes taken out of sfs_vnhash */
+	struct lock *sfs_freemaplock;   /* protects the freemap and superblock */
+};
+
+/*
+ * Lock ordering: a directory's sv_lock before the sv_lock of anything
+ * in it, then sfs_vnlock, then sfs_freemaplock, then the buffer cache
+ * lock. Two vnodes not related that way are locked in address order.
+ */
+
+/*
+ * Buffer cache entry: one disk block of a mounted SFS. Buffers are
+ * shared by everybody using the block; hold a reference (from
+ * sfs_bread or sfs_bget) while looking at b_data.
+ */
+struct sfs_buf {
+	struct sfs_fs *b_fs;            /* filesystem, NULL if unused */
+	uint32_t b_block;               /* disk block held */
+	unsigned b_refcount;            /* number of users */
+	bool b_valid;                   /* b_data holds the block contents */
+	bool b_dirty;                   /* b_data must be written back */
+	bool b_busy;                    /* being read or written */
+	time_t b_dirtytime;             /* when it last became dirty */
+	struct sfs_vnode *b_owner;      /* file it was dirtied for, if any */
+	bool b_meta;                    /* holds an indirect block of b_owner */
+	struct sfs_buf *b_ownnext;      /* owner's sv_dirtybufs list */
+	struct sfs_buf *b_ownprev;
+	struct sfs_buf *b_hashnext;     /* hash chain */
+	struct sfs_buf *b_lrunext;      /* LRU list */
+	struct sfs_buf *b_lruprev;
+	char b_data[SFS_BLOCKSIZE];
 };
 
 /*
@@ -79,11 +130,33 @@ int sfs_mount(const char *device);
 #define SFSUIO(iov, uio, ptr, block, rw) \
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
-/* Convenience functions for block I/O */
+/* Most blocks sent to the device in a single request */
+#define SFS_CLUSTER 16
+
+/* Convenience functions for block I/O; rblock and wblock go through the cache */
 int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/* Buffer cache (sfs_cache.c) */
+int sfs_binit(void);
+int sfs_bread(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+int sfs_bget(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+void sfs_bdirty(struct sfs_buf *b);
+void sfs_bdirtyfile(struct sfs_buf *b, struct sfs_vnode *sv, bool meta);
+void sfs_brelse(struct sfs_buf *b);
+void sfs_bdiscard(struct sfs_fs *sfs, uint32_t block);
+void sfs_bprefetch(struct sfs_fs *sfs, uint32_t block);
+int sfs_bsync(struct sfs_fs *sfs);
+int sfs_bsyncfile(struct sfs_vnode *sv, bool meta);
+int sfs_bsyncrange(struct sfs_fs *sfs, uint32_t block, uint32_t n);
+void sfs_bdisown(struct sfs_vnode *sv);
+void sfs_binval(struct sfs_fs *sfs);
+void sfs_bstats(void);
+
+/* Write the free block map out to disk if it has changed (sfs_fs.c) */
+int sfs_syncmap(struct sfs_fs *sfs);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
@@ -0,0 +1,36 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space for the VM system: page-sized slots on a raw disk device.
+ *
+ * Each slot has a reference count, since a page that was swapped out
+ * can be shared by a parent and child after fork.
+ *
+ * Functions:
+ *       swap_bootstrap - open the swap device. If it is missing the
+ *                   system runs without swap and allocation fails
+ *                   once memory is exhausted.
+ *       swap_alloc  - reserve a free slot. Returns ENOSPC if the swap
+ *                   device is full or missing.
+ *       swap_incref - add another reference to a slot.
+ *       swap_free   - drop a reference, the slot is reusable once the
+ *                   last one is gone.
+ *       swap_read   - copy a slot into the frame at PADDR.
+ *       swap_write  - copy the frame at PADDR into a slot.
+ *
+ * swap_alloc, swap_incref and swap_free only take a spinlock, so they
+ * may be called with the core-map lock held. swap_read and swap_write
+ * sleep on disk I/O.
+ */
+
+#define SWAP_DEVICE "lhd1raw:"
+
+void swap_bootstrap(void);
+int  swap_alloc(unsigned *slot);
+void swap_incref(unsigned slot);
+void swap_free(unsigned slot);
+int  swap_read(unsigned slot, paddr_t paddr);
+int  swap_write(unsigned slot, paddr_t paddr);
+
+#endif /* _SWAP_H_ */
@@ -31,6 +31,7 @@
 #define _SYSCALL_H_
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -70,6 +71,16 @@ int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_execv(const_userptr_t progname, const_userptr_t *args, int *retval);
 #endif
 
+#if OPT_A3
+int sys_open(const_userptr_t path, int flags, mode_t mode, int *retval);
+int sys_close(int fdesc);
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+             off_t offset, vaddr_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_msync(userptr_t addr, size_t len, int flags);
+#endif
+
 #endif // UW
 
 #endif /* _SYSCALL_H_ */
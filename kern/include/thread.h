@@ -157,6 +157,18 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Return true if another thread is waiting to run on the current cpu.
+ * For background work that should only use otherwise idle time.
+ */
+bool thread_cpu_busy(void);
+
+/*
+ * Sleep until a cpu runs out of other threads to run; that cpu then
+ * runs the caller instead of idling. For the same kind of work.
+ */
+void thread_idle_wait(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
@@ -185,8 +185,9 @@ DECLARRAY(vnode);
 DEFARRAY(vnode, VFSINLINE);
 
 /*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
+ * Global one-big-lock for filesystem operations. SFS no longer uses
+ * it for file I/O; it still serializes mounting, unmounting, name
+ * lookup in the VFS layer, and emufs.
  */
 void vfs_biglock_acquire(void);
 void vfs_biglock_release(void);
@@ -40,6 +40,8 @@
 
 #if OPT_A3
 
+struct vnode;
+
 struct coremap_entry {
 	paddr_t addr_base;
 	long num_frame; // num of frames
@@ -47,13 +49,53 @@ struct coremap_entry {
 	// 		1 indicates this frame only is allocated
 	//		0 indicates this frame is available
 	// 		-1 indicates this frame was allocated with some previous frames together
+	unsigned refcount; // num of page table entries (address spaces) sharing this frame
+	// Page table entry that maps this frame, if it is the only one.
+	// NULL for kernel frames and frames shared with other address spaces.
+	struct addrspace *owner;
+	struct pagetable_entry *pte;
+	vaddr_t vaddr; // where the owner, or every sharer, maps a user frame
+	bool referenced; // used since the eviction clock hand last passed
+	int free_order; // order of the free buddy block this frame starts, -1 if none
+	long free_next; // neighbours on that order's free list, -1 if none
+	long free_prev;
+	// Part of an executable this frame holds a clean read-only copy of,
+	// or page of a shared mapping it holds, so that other processes
+	// running the executable or mapping the file can map the same frame.
+	// tc_vnode is NULL if the frame is not in the text cache.
+	struct vnode *tc_vnode;
+	off_t tc_offset; // file offset the start of the page maps to
+	unsigned short tc_lo, tc_hi; // bytes of the page read from the file
+	bool tc_mapped; // page of a shared mapping rather than text
+	long tc_next; // next frame in the same hash chain, -1 if none
 };
 
+// Packed into 8 bytes so that a second-level table fills exactly one page
 struct pagetable_entry {
-	paddr_t addr_base;
-	// only 1 field in the struct but using structure is easier to add some flags later on
+	paddr_t addr_base; // 0 if the page is not in memory
+	unsigned cow : 1; // frame is shared copy-on-write with another address space
+	unsigned busy : 1; // being paged in or out, wait on core_map_cv
+	unsigned swapped : 1; // contents live in swap slot swap_slot
+	unsigned readonly : 1; // page of a region that is not writeable
+	unsigned mapped : 1; // page of a shared file mapping, written back to the file
+	unsigned dirty : 1; // mapped page written since it was last written back
+	unsigned swap_slot : 26;
 };
 
+/*
+ * User page tables have two levels. The first level has an entry for
+ * every PT_L2_SPAN bytes of user space, pointing to a second-level
+ * table of PT_L2_ENTRIES page table entries, or NULL if nothing in
+ * that range has been touched.
+ */
+#define PT_L2_BITS     9
+#define PT_L2_ENTRIES  (1 << PT_L2_BITS)
+#define PT_L1_SHIFT    (12 + PT_L2_BITS)
+#define PT_L2_SPAN     (1 << PT_L1_SHIFT)
+#define PT_L1_ENTRIES  (USERSPACETOP >> PT_L1_SHIFT)
+#define PT_L1_INDEX(vaddr) ((vaddr) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(vaddr) (((vaddr) >> 12) & (PT_L2_ENTRIES - 1))
+
 #endif
 
 
@@ -71,6 +113,20 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+#if OPT_A3
+/*
+ * Choose how a full TLB picks the entry to replace: "random",
+ * "roundrobin" or "clock". Returns EINVAL for anything else.
+ */
+int vm_set_tlb_policy(const char *name);
+
+/*
+ * Set how many pages the user stack may grow to. Returns EINVAL if
+ * NPAGES does not leave room for the rest of user space.
+ */
+int vm_set_stack_limit(unsigned npages);
+#endif
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
@@ -47,8 +47,18 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * Searches for clear bits do look at a machine word at a time, to skip
+ * over the parts that are full. An all-ones word is the same in any
+ * byte order, so this does not make the data endian-dependent.
+ */
+#define SCAN_TYPE       uint32_t
+#define SCAN_ALLBITS    (0xffffffff)
+#define WORDS_PER_SCAN  (sizeof(SCAN_TYPE)/sizeof(WORD_TYPE))
+
 struct bitmap {
         unsigned nbits;
+        unsigned hint;          /* where bitmap_alloc starts looking */
         WORD_TYPE *v;
 };
 
@@ -72,6 +82,7 @@ bitmap_create(unsigned nbits)
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
+        b->hint = 0;
 
         /* Mark any leftover bits at the end in use */
         if (words > nbits / BITS_PER_WORD) {
@@ -95,26 +106,180 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+/*
+ * Number of set bits below the lowest clear bit of W, which must not be
+ * all ones.
+ */
+static
+inline
+unsigned
+bitmap_ctone(WORD_TYPE w)
+{
+        unsigned n = 0;
+
+        KASSERT(w != WORD_ALLBITS);
+
+        if ((w & 0x0f) == 0x0f) {
+                n += 4;
+                w >>= 4;
+        }
+        if ((w & 0x03) == 0x03) {
+                n += 2;
+                w >>= 2;
+        }
+        if ((w & 0x01) == 0x01) {
+                n += 1;
+        }
+        return n;
+}
+
+/*
+ * Index of the first word from IX up to MAXIX that is not all ones, or
+ * MAXIX if there is none. Words are compared SCAN_TYPE at a time,
+ * copied out so that the map needs no particular alignment.
+ */
+static
+unsigned
+bitmap_scanword(const struct bitmap *b, unsigned ix, unsigned maxix)
+{
+        SCAN_TYPE scan;
+
+        while (ix + WORDS_PER_SCAN <= maxix) {
+                memcpy(&scan, &b->v[ix], sizeof(scan));
+                if (scan != SCAN_ALLBITS) {
+                        break;
+                }
+                ix += WORDS_PER_SCAN;
+        }
+        while (ix < maxix && b->v[ix] == WORD_ALLBITS) {
+                ix++;
+        }
+        return ix;
+}
+
+/*
+ * Find the first clear bit from START up to (not including) END.
+ */
+static
+int
+bitmap_findbetween(const struct bitmap *b, unsigned start, unsigned end,
+                   unsigned *index)
+{
+        unsigned ix = start / BITS_PER_WORD;
+        unsigned maxix = DIVROUNDUP(end, BITS_PER_WORD);
+        unsigned offset = start % BITS_PER_WORD;
+        WORD_TYPE w;
+
+        if (start >= end) {
+                return ENOSPC;
+        }
+
+        /* In the first word, pretend the bits before START are set */
+        if (offset > 0) {
+                w = b->v[ix] | (WORD_TYPE)((1U << offset) - 1);
+                if (w != WORD_ALLBITS) {
+                        *index = ix*BITS_PER_WORD + bitmap_ctone(w);
+                        return *index < end ? 0 : ENOSPC;
+                }
+                ix++;
+        }
+
+        ix = bitmap_scanword(b, ix, maxix);
+        if (ix == maxix) {
+                return ENOSPC;
+        }
+        *index = ix*BITS_PER_WORD + bitmap_ctone(b->v[ix]);
+        return *index < end ? 0 : ENOSPC;
+}
+
+/*
+ * Number of clear bits starting at BIT, counting no further than MAX.
+ */
+static
+unsigned
+bitmap_zerorun(const struct bitmap *b, unsigned bit, unsigned max)
+{
+        unsigned n = 0;
+        unsigned ix, offset;
+
+        while (n < max && bit + n < b->nbits) {
+                ix = (bit + n) / BITS_PER_WORD;
+                offset = (bit + n) % BITS_PER_WORD;
+                if (offset == 0 && b->v[ix] == 0 &&
+                    n + BITS_PER_WORD <= max) {
+                        n += BITS_PER_WORD;
+                        continue;
+                }
+                if (b->v[ix] & ((WORD_TYPE)1 << offset)) {
+                        break;
+                }
+                n++;
+        }
+        return n < max ? n : max;
+}
+
+int
+bitmap_findzero(struct bitmap *b, unsigned start, unsigned *index)
+{
+        if (start >= b->nbits) {
+                start = 0;
+        }
+        if (bitmap_findbetween(b, start, b->nbits, index) == 0) {
+                return 0;
+        }
+        return bitmap_findbetween(b, 0, start, index);
+}
+
 int
 bitmap_alloc(struct bitmap *b, unsigned *index)
 {
+        WORD_TYPE mask;
         unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        int result;
+
+        /* Go on from where the last allocation left off */
+        result = bitmap_findzero(b, b->hint, index);
+        if (result) {
+                return result;
+        }
+        KASSERT(*index < b->nbits);
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+        ix = *index / BITS_PER_WORD;
+        mask = ((WORD_TYPE)1) << (*index % BITS_PER_WORD);
+        b->v[ix] |= mask;
+        b->hint = *index + 1;
+        return 0;
+}
+
+int
+bitmap_alloc_range(struct bitmap *b, unsigned start, unsigned n,
+                   unsigned *index)
+{
+        unsigned pass, from, to, pos, len, i, z;
+        WORD_TYPE mask;
+
+        KASSERT(n > 0);
+        if (start >= b->nbits) {
+                start = 0;
+        }
 
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
+        /* Look from START to the end, then from the beginning */
+        for (pass=0; pass<2; pass++) {
+                from = pass == 0 ? start : 0;
+                to = pass == 0 ? b->nbits : start;
+                pos = from;
+                while (bitmap_findbetween(b, pos, to, &z) == 0) {
+                        len = bitmap_zerorun(b, z, n);
+                        if (len == n) {
+                                for (i=z; i<z+n; i++) {
+                                        mask = ((WORD_TYPE)1) << (i % BITS_PER_WORD);
+                                        b->v[i / BITS_PER_WORD] |= mask;
                                 }
+                                *index = z;
+                                return 0;
                         }
-                        KASSERT(0);
+                        /* The bit after the run is set; go past it */
+                        pos = z + len + 1;
                 }
         }
         return ENOSPC;
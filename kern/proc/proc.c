@@ -43,6 +43,7 @@
  */
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 #include <types.h>
 #include <proc.h>
@@ -111,6 +112,13 @@ proc_create(const char *name)
 	proc->console = NULL;
 #endif // UW
 
+#if OPT_A3
+	for (int fd = 0; fd < OPEN_MAX; ++fd) {
+		proc->p_files[fd] = NULL;
+		proc->p_fileflags[fd] = 0;
+	}
+#endif
+
 #if OPT_A2
 	proc->pid = PID_MIN;
 	proc->parent = NULL;
@@ -247,6 +255,15 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
+#if OPT_A3
+	for (int fd = 0; fd < OPEN_MAX; ++fd) {
+		if (proc->p_files[fd] != NULL) {
+			vfs_close(proc->p_files[fd]);
+			proc->p_files[fd] = NULL;
+		}
+	}
+#endif
+
 	threadarray_cleanup(&proc->p_threads);
 	spinlock_cleanup(&proc->p_lock);
 
@@ -363,6 +380,25 @@ proc_create_runprogram(const char *name)
 	return proc;
 }
 
+#if OPT_A3
+/*
+ * Give TO (a process being forked, with no files of its own yet) a
+ * reference to each of FROM's open files, under the same descriptors.
+ */
+void
+proc_copyfiles(struct proc *from, struct proc *to)
+{
+	for (int fd = 0; fd < OPEN_MAX; ++fd) {
+		KASSERT(to->p_files[fd] == NULL);
+		if (from->p_files[fd] != NULL) {
+			VOP_INCREF(from->p_files[fd]);
+			to->p_files[fd] = from->p_files[fd];
+			to->p_fileflags[fd] = from->p_fileflags[fd];
+		}
+	}
+}
+#endif
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
@@ -45,6 +45,11 @@
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-A3.h"
+
+#if OPT_A3
+#include <vm.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -238,6 +243,41 @@ cmd_dth(int nargs, char **args) {
 }
 
 
+#if OPT_A3
+
+/*
+ * Command for choosing the TLB replacement policy, e.g. from the boot
+ * command line before running a program.
+ */
+static
+int
+cmd_tlbpolicy(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: tlbp random|roundrobin|clock\n");
+		return EINVAL;
+	}
+
+	return vm_set_tlb_policy(args[1]);
+}
+
+/*
+ * Command for setting how many pages a user stack may grow to.
+ */
+static
+int
+cmd_stacklimit(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: stklim <pages>\n");
+		return EINVAL;
+	}
+
+	return vm_set_stack_limit(atoi(args[1]));
+}
+
+#endif
+
 /*
  * Command for printing the current directory.
  */
@@ -421,6 +461,20 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_SFS
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_bstats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -463,6 +517,10 @@ static const char *opsmenu[] = {
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	"[dth]     Enable debugging messages of type DB_THREADS ",
+#if OPT_A3
+	"[tlbp]    Set TLB replacement policy",
+	"[stklim]  Set user stack size limit (pages)",
+#endif
 	NULL
 };
 
@@ -531,6 +589,9 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+#if OPT_SFS
+	"[bc] SFS buffer cache stats         ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -576,6 +637,10 @@ static struct {
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
 	{ "dth",    cmd_dth },
+#if OPT_A3
+	{ "tlbp",	cmd_tlbpolicy },
+	{ "stklim",	cmd_stacklimit },
+#endif
 
 #if OPT_SYNCHPROBS
 	/* in-kernel synchronization problem(s) */
@@ -588,6 +653,9 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if OPT_SFS
+	{ "bc",         cmd_bufstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
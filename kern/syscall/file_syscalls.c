@@ -1,7 +1,12 @@
+#include "opt-A3.h"
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
 #include <kern/unistd.h>
 #include <lib.h>
+#include <limits.h>
+#include <copyinout.h>
 #include <uio.h>
 #include <syscall.h>
 #include <vnode.h>
@@ -58,3 +63,68 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
   KASSERT(*retval >= 0);
   return 0;
 }
+
+#if OPT_A3
+
+/* handler for open() system call                   */
+/*
+ * Opens the file in the process's table under the lowest free
+ * descriptor. Descriptors 0-2 stay the console's. The table only
+ * names files for mmap(); read() and write() still only go to the
+ * console.
+ */
+
+int
+sys_open(const_userptr_t path, int flags, mode_t mode, int *retval)
+{
+  char kpath[PATH_MAX];
+  struct vnode *vn;
+  int fd;
+  int res;
+
+  KASSERT(curproc != NULL);
+
+  for (fd = STDERR_FILENO + 1; fd < OPEN_MAX; fd++) {
+    if (curproc->p_files[fd] == NULL) {
+      break;
+    }
+  }
+  if (fd == OPEN_MAX) {
+    return EMFILE;
+  }
+
+  res = copyinstr(path, kpath, sizeof(kpath), NULL);
+  if (res) {
+    return res;
+  }
+
+  /* vfs_open checks the flags */
+  res = vfs_open(kpath, flags, mode, &vn);
+  if (res) {
+    return res;
+  }
+
+  curproc->p_files[fd] = vn;
+  curproc->p_fileflags[fd] = flags & O_ACCMODE;
+  *retval = fd;
+  return 0;
+}
+
+/* handler for close() system call                  */
+
+int
+sys_close(int fdesc)
+{
+  KASSERT(curproc != NULL);
+
+  if (fdesc < 0 || fdesc >= OPEN_MAX || curproc->p_files[fdesc] == NULL) {
+    return EBADF;
+  }
+
+  vfs_close(curproc->p_files[fdesc]);
+  curproc->p_files[fdesc] = NULL;
+  curproc->p_fileflags[fdesc] = 0;
+  return 0;
+}
+
+#endif
@@ -50,6 +50,7 @@
  * linker). And you'd have to write a dynamic linker...
  */
 
+#include "opt-A3.h"
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
@@ -73,6 +74,10 @@
  * executable whose load address is in kernel space. If you should
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
+ *
+ * With OPT_A3 nothing is read here: the segment is only attached to
+ * the address space and vm_fault reads each page in on first touch.
+ * as_define_region has already rejected segments outside user space.
  */
 static
 int
@@ -81,15 +86,28 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
+#if !OPT_A3
 	struct iovec iov;
 	struct uio u;
 	int result;
+#endif
 
 	if (filesize > memsize) {
 		kprintf("ELF: warning: segment filesize > segment memsize\n");
 		filesize = memsize;
 	}
 
+#if OPT_A3
+
+	(void)is_executable;
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n", 
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_define_source(as, v, offset, vaddr, filesize);
+
+#else
+
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n", 
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
@@ -143,6 +161,8 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 	
 	return result;
+
+#endif /* OPT_A3 */
 }
 
 /*
@@ -1,4 +1,5 @@
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 
 #include <types.h>
@@ -13,6 +14,11 @@
 #include <addrspace.h>
 #include <copyinout.h>
 
+#if OPT_A3
+
+#include <kern/mman.h>
+
+#endif
 
 #if OPT_A2
 
@@ -176,6 +182,99 @@ sys_getpid(pid_t *retval)
   return 0;
 }
 
+#if OPT_A3
+
+/* move the end of the heap, handing back where it was */
+
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+  struct addrspace *as = curproc_getas();
+  KASSERT(as != NULL);
+
+  return as_sbrk(as, amount, retval);
+}
+
+/* map part of an open file into memory; ADDR is only a hint and is ignored */
+
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+         off_t offset, vaddr_t *retval)
+{
+  struct addrspace *as = curproc_getas();
+  struct vnode *vn;
+  int accmode;
+  KASSERT(as != NULL);
+
+  (void)addr;
+
+  if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+    return EINVAL;
+  }
+
+  /* pages are either read-only or read/write, and anything readable
+     is executable; other protections cannot be enforced */
+  if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+    return EINVAL;
+  }
+  if ((prot & PROT_READ) == 0) {
+    return ENOTSUP;
+  }
+
+  /* the console descriptors are not in the file table and cannot be
+     mapped anyway */
+  if (fd >= STDIN_FILENO && fd <= STDERR_FILENO) {
+    return ENODEV;
+  }
+  if (fd < 0 || fd >= OPEN_MAX || curproc->p_files[fd] == NULL) {
+    return EBADF;
+  }
+  vn = curproc->p_files[fd];
+  accmode = curproc->p_fileflags[fd];
+
+  /* pages are read in from the file, and shared writable ones are
+     written back to it */
+  if (accmode == O_WRONLY) {
+    return EACCES;
+  }
+  if (flags == MAP_SHARED && (prot & PROT_WRITE) != 0 && accmode != O_RDWR) {
+    return EACCES;
+  }
+
+  return as_mmap(as, vn, offset, len,
+                 (prot & PROT_WRITE) != 0, flags == MAP_SHARED, retval);
+}
+
+/* remove a mapping made by mmap, writing changes back first */
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+  struct addrspace *as = curproc_getas();
+  KASSERT(as != NULL);
+
+  return as_munmap(as, (vaddr_t)addr, len);
+}
+
+/* write changes to shared mappings back to their files; all writes are
+   synchronous, so MS_ASYNC and MS_INVALIDATE need no extra work */
+
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+  struct addrspace *as = curproc_getas();
+  KASSERT(as != NULL);
+
+  if ((flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) != 0 ||
+      (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC)) {
+    return EINVAL;
+  }
+
+  return as_msync(as, (vaddr_t)addr, len);
+}
+
+#endif
+
 /* stub handler for waitpid() system call                */
 
 int
@@ -315,6 +414,11 @@ sys_fork(struct trapframe *tf,
   // Associate the address_space created with child process
   child->p_addrspace = child_as;
 
+#if OPT_A3
+  // The child gets its own references to the parent's open files
+  proc_copyfiles(p, child);
+#endif
+
   // Assign PID to child process and create the parent/child relationship
   lock_acquire(PID_lock);
 
@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -101,6 +102,21 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* Free a run of 10 and a run of 20; a run of 15 must go in the second */
+	for (i=100; i<110; i++) {
+		bitmap_unmark(b, i);
+	}
+	for (i=300; i<320; i++) {
+		bitmap_unmark(b, i);
+	}
+	KASSERT(bitmap_findzero(b, 0, &x)==0 && x==100);
+	KASSERT(bitmap_findzero(b, 200, &x)==0 && x==300);
+	KASSERT(bitmap_findzero(b, 400, &x)==0 && x==100);
+	KASSERT(bitmap_alloc_range(b, 0, 15, &x)==0 && x==300);
+	KASSERT(bitmap_alloc_range(b, 0, 15, &x)==ENOSPC);
+	KASSERT(bitmap_alloc_range(b, 400, 10, &x)==0 && x==100);
+	KASSERT(bitmap_findzero(b, 0, &x)==0 && x==315);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
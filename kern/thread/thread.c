@@ -72,6 +72,10 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Background threads waiting for a cpu to have nothing else to run. */
+static struct wchan *idle_wchan;
+static bool thread_idle_wake(void);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -380,6 +384,11 @@ thread_bootstrap(void)
 	/* cpu_create() should have set t_proc. */
 	KASSERT(curthread->t_proc != NULL);
 
+	idle_wchan = wchan_create("idle");
+	if (idle_wchan == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/* Done */
 }
 
@@ -635,7 +644,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/* Background work gets the time before idling */
+			if (!thread_idle_wake()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -808,6 +820,58 @@ thread_exit(void)
 	panic("The zombie walks!\n");
 }
 
+/*
+ * Sleep until some cpu has nothing else to run, for threads that
+ * should only use otherwise idle time.
+ */
+void
+thread_idle_wait(void)
+{
+	wchan_lock(idle_wchan);
+	wchan_sleep(idle_wchan);
+}
+
+/*
+ * Called by a cpu about to go idle: move one thread waiting in
+ * thread_idle_wait onto this cpu's run queue instead. Returns true if
+ * there was one. The run queue must not be locked.
+ */
+static
+bool
+thread_idle_wake(void)
+{
+	struct thread *target;
+
+	spinlock_acquire(&idle_wchan->wc_lock);
+	target = threadlist_remhead(&idle_wchan->wc_threads);
+	spinlock_release(&idle_wchan->wc_lock);
+
+	if (target == NULL) {
+		return false;
+	}
+
+	/* Nobody else can touch it while it is on no list */
+	target->t_cpu = curcpu->c_self;
+	thread_make_runnable(target, false);
+	return true;
+}
+
+/*
+ * Check whether another thread is waiting to run on this cpu, for
+ * threads that should only run when the cpu would otherwise be idle.
+ */
+bool
+thread_cpu_busy(void)
+{
+	bool busy;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	busy = !threadlist_isempty(&curcpu->c_runqueue);
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return busy;
+}
+
 /*
  * Yield the cpu to another process, but stay runnable.
  */
@@ -1162,6 +1226,28 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send the same TLB shootdown to every CPU in the mask CPUS (bit N
+ * is CPU number N), except the current one. Returns how many CPUs it
+ * was sent to.
+ */
+unsigned
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping, uint32_t cpus)
+{
+	unsigned i, n = 0;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && (cpus & ((uint32_t)1 << c->c_number))) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+
+	return n;
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -0,0 +1,177 @@
+/*
+ * Swap space for the VM system. See swap.h for details.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+
+// Raw disk the slots live on, NULL if we run without swap
+static struct vnode *swap_vnode;
+
+// Number of slots on the swap device
+static unsigned swap_nslots;
+
+// Reference count of each slot, 0 means free
+static unsigned short *swap_map;
+
+// Where to start looking for a free slot
+static unsigned swap_hint;
+
+// Protects swap_map and swap_hint
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+void
+swap_bootstrap(void)
+{
+	struct stat st;
+	char path[sizeof(SWAP_DEVICE)];
+	int result;
+
+	// vfs_open may scribble on the path
+	strcpy(path, SWAP_DEVICE);
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s, running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		kprintf("swap: %s: stat: %s, running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+
+	swap_map = kmalloc(sizeof(unsigned short)*swap_nslots);
+	if (swap_map == NULL) {
+		kprintf("swap: out of memory for swap map, running without swap\n");
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	for (unsigned i = 0; i < swap_nslots; ++i) {
+		swap_map[i] = 0;
+	}
+	swap_hint = 0;
+
+	kprintf("swap: %s: %u pages\n", SWAP_DEVICE, swap_nslots);
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+
+	for (unsigned n = 0; n < swap_nslots; ++n) {
+		unsigned i = (swap_hint + n) % swap_nslots;
+		if (swap_map[i] == 0) {
+			swap_map[i] = 1;
+			swap_hint = (i + 1) % swap_nslots;
+			spinlock_release(&swap_lock);
+			*slot = i;
+			return 0;
+		}
+	}
+
+	spinlock_release(&swap_lock);
+	return ENOSPC;
+}
+
+void
+swap_incref(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_map[slot] > 0);
+	++swap_map[slot];
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_map[slot] > 0);
+	--swap_map[slot];
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Move a page between the frame at PADDR and SLOT.
+ */
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &u);
+	} else {
+		result = VOP_WRITE(swap_vnode, &u);
+	}
+	if (result) {
+		return result;
+	}
+
+	if (u.uio_resid != 0) {
+		kprintf("swap: short %s on slot %u\n",
+			rw == UIO_READ ? "read" : "write", slot);
+		return EIO;
+	}
+
+	return 0;
+}
+
+int
+swap_read(unsigned slot, paddr_t paddr)
+{
+	int result = swap_io(slot, paddr, UIO_READ);
+	if (result == 0) {
+		vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	}
+	return result;
+}
+
+int
+swap_write(unsigned slot, paddr_t paddr)
+{
+	int result = swap_io(slot, paddr, UIO_WRITE);
+	if (result == 0) {
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	}
+	return result;
+}
@@ -33,6 +33,9 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "Frame Cache Refills",
+ /* 11 */ "Frame Cache Drains",
+ /* 12 */ "Shared Text Pages",
 };
 
 
@@ -95,12 +95,43 @@ dodirblock(uint32_t block)
 	}
 }
 
+/*
+ * Dump the directory blocks under indirect block BLOCK, LEVELS deep
+ * (1 for a single indirect block), counting them in *NBLOCKSP.
+ */
+static
+void
+dumpindirect(uint32_t block, int levels, uint32_t *nblocksp)
+{
+	uint32_t ib[SFS_DBPERIDB];
+	uint32_t entry;
+	int i;
+
+	if (block == 0) {
+		return;
+	}
+
+	diskread(&ib, block);
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		entry = SWAPL(ib[i]);
+		if (entry == 0) {
+			continue;
+		}
+		if (levels > 1) {
+			dumpindirect(entry, levels-1, nblocksp);
+		}
+		else {
+			dodirblock(entry);
+			(*nblocksp)++;
+		}
+	}
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
 	int nentries, i;
 	uint32_t block, nblocks=0;
 
@@ -119,16 +150,9 @@ dumpdir(uint32_t ino)
 			nblocks++;
 		}
 	}
-	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
-	}
+	dumpindirect(SWAPL(sfi.sfi_indirect), 1, &nblocks);
+	dumpindirect(SWAPL(sfi.sfi_dindirect), 2, &nblocks);
+	dumpindirect(SWAPL(sfi.sfi_tindirect), 3, &nblocks);
 	printf("    %u blocks in directory\n", nblocks);
 }
 